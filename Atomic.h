@@ -0,0 +1,143 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include <boost/cstdint.hpp>
+
+#ifdef _WIN32
+#include <intrin.h>
+#pragma intrinsic(_InterlockedExchange, _InterlockedCompareExchange, _InterlockedIncrement, _InterlockedDecrement, _InterlockedExchangeAdd, _InterlockedCompareExchange64)
+#endif
+
+namespace Music
+{
+
+///////////////////////////
+// Atomic operations
+///////////////////////////
+// Small set of lock free operations on a long, used to hand data between
+// the audio thread and other threads without ever blocking. Every operation
+// is a full memory barrier.
+
+inline long AtomicLoad(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedCompareExchange(value, 0, 0);
+#else
+	return __sync_val_compare_and_swap(value, 0, 0);
+#endif
+}
+
+inline void AtomicStore(volatile long* value, long newValue)
+{
+#ifdef _WIN32
+	_InterlockedExchange(value, newValue);
+#else
+	__sync_synchronize();
+	*value = newValue;
+	__sync_synchronize();
+#endif
+}
+
+// Set value to newValue. Returns the old value.
+inline long AtomicExchange(volatile long* value, long newValue)
+{
+#ifdef _WIN32
+	return _InterlockedExchange(value, newValue);
+#else
+	// __sync_lock_test_and_set is only an acquire barrier
+	long old = *value;
+	for (;;) {
+		long seen = __sync_val_compare_and_swap(value, old, newValue);
+		if (seen == old) {
+			return old;
+		}
+		old = seen;
+	}
+#endif
+}
+
+// Set value to newValue if it is equal to expected. Returns the old value.
+inline long AtomicCompareExchange(volatile long* value, long newValue, long expected)
+{
+#ifdef _WIN32
+	return _InterlockedCompareExchange(value, newValue, expected);
+#else
+	return __sync_val_compare_and_swap(value, expected, newValue);
+#endif
+}
+
+// Returns the new value
+inline long AtomicIncrement(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedIncrement(value);
+#else
+	return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+// Returns the new value
+inline long AtomicDecrement(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedDecrement(value);
+#else
+	return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+// Returns the old value
+inline long AtomicAdd(volatile long* value, long amount)
+{
+#ifdef _WIN32
+	return _InterlockedExchangeAdd(value, amount);
+#else
+	return __sync_fetch_and_add(value, amount);
+#endif
+}
+
+// 64 bit counterparts. 32 bit Windows only has a 64 bit compare exchange, so
+// the others are built on it.
+
+inline boost::int64_t AtomicCompareExchange64(volatile boost::int64_t* value, boost::int64_t newValue, boost::int64_t expected)
+{
+#ifdef _WIN32
+	return _InterlockedCompareExchange64(value, newValue, expected);
+#else
+	return __sync_val_compare_and_swap(value, expected, newValue);
+#endif
+}
+
+inline boost::int64_t AtomicLoad64(volatile boost::int64_t* value)
+{
+	return AtomicCompareExchange64(value, 0, 0);
+}
+
+// Returns the old value
+inline boost::int64_t AtomicAdd64(volatile boost::int64_t* value, boost::int64_t amount)
+{
+	boost::int64_t old = AtomicLoad64(value);
+	for (;;) {
+		boost::int64_t seen = AtomicCompareExchange64(value, old + amount, old);
+		if (seen == old) {
+			return old;
+		}
+		old = seen;
+	}
+}
+
+inline void AtomicStore64(volatile boost::int64_t* value, boost::int64_t newValue)
+{
+	boost::int64_t old = AtomicLoad64(value);
+	for (;;) {
+		boost::int64_t seen = AtomicCompareExchange64(value, newValue, old);
+		if (seen == old) {
+			return;
+		}
+		old = seen;
+	}
+}
+
+}
+
+#endif
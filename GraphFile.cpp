@@ -0,0 +1,466 @@
+#include "GraphFile.h"
+#include <cstring>
+#include <cfloat>
+#include <boost/static_assert.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace std;
+
+namespace Music
+{
+
+namespace
+{
+
+const char GraphFileMagic[4] = { 'L', 'U', 'M', 'G' };
+// reads back differently on a machine with the other byte order
+const boost::uint32_t GraphFileByteOrder = 0x01020304;
+
+struct GraphFileHeader
+{
+	char magic[4];
+	boost::uint32_t byteOrder;
+	boost::uint32_t version;
+	boost::uint32_t nodeCount;
+	boost::uint32_t nodesOffset;
+	boost::uint32_t refCount;
+	boost::uint32_t refsOffset;
+	boost::uint32_t rootCount;
+	boost::uint32_t rootsOffset;
+	boost::uint32_t eventCount;
+	boost::uint32_t eventsOffset;
+	boost::uint32_t stringsSize;
+	boost::uint32_t stringsOffset;
+};
+
+struct GraphRoot
+{
+	boost::uint32_t node;
+	boost::uint32_t nameOffset;
+	boost::uint32_t nameSize;
+};
+
+// events are read in place, so the records they sit between must keep them aligned
+BOOST_STATIC_ASSERT(sizeof(GraphFileHeader) % 4 == 0);
+BOOST_STATIC_ASSERT(sizeof(GraphNode) % 4 == 0);
+BOOST_STATIC_ASSERT(sizeof(GraphRef) % 4 == 0);
+BOOST_STATIC_ASSERT(sizeof(GraphRoot) % 4 == 0);
+
+// A mapped graph file. Loaded static sequences hold on to it.
+struct MappedGraphFile
+{
+	MappedGraphFile(const char* path) :
+		file(path, boost::interprocess::read_only), region(file, boost::interprocess::read_only) {}
+
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+};
+
+// True if count records of recordSize starting at offset fit in the file
+bool InFile(boost::uint64_t fileSize, boost::uint32_t offset, boost::uint32_t count, boost::uint32_t recordSize)
+{
+	return offset <= fileSize && static_cast<boost::uint64_t>(count) * recordSize <= fileSize - offset;
+}
+
+// static sequences are played straight out of the mapping, so every event
+// is checked before any of them can reach a track
+bool ValidEvent(const MusicEvent& event)
+{
+	// NaN fails both comparisons
+	if (!(event.length >= 0 && event.length <= FLT_MAX)) {
+		return false;
+	}
+	if (event.type == REST_EVENT) {
+		return true;
+	}
+	return event.type == NOTE_EVENT && event.pitch >= 0 && event.pitch < NumMidiPitches && event.velocity <= 127;
+}
+
+}
+
+///////////////////////////
+// Graph writer
+///////////////////////////
+
+bool GraphWriter::Add(const Generator* gen, boost::uint32_t& index)
+{
+	if (!gen) {
+		index = GraphNullNode;
+		return true;
+	}
+	map<const Generator*, boost::uint32_t>::iterator it = indices_.find(gen);
+	if (it != indices_.end()) {
+		index = it->second;
+		return true;
+	}
+	if (!gen->Save(*this, index)) {
+		cerr << "Can not save generator " << gen->Name() << endl;
+		return false;
+	}
+	indices_[gen] = index;
+	return true;
+}
+
+boost::uint32_t GraphWriter::AddNode(GraphNodeType type, const vector<GraphRef>& refs, boost::uint32_t a, boost::uint32_t b)
+{
+	GraphNode node = { type, static_cast<boost::uint32_t>(refs_.size()), static_cast<boost::uint32_t>(refs.size()), a, b };
+	refs_.insert(refs_.end(), refs.begin(), refs.end());
+	nodes_.push_back(node);
+	return nodes_.size() - 1;
+}
+
+boost::uint32_t GraphWriter::AddNode(GraphNodeType type, boost::uint32_t a, boost::uint32_t b)
+{
+	return AddNode(type, vector<GraphRef>(), a, b);
+}
+
+boost::uint32_t GraphWriter::AddString(const string& str)
+{
+	boost::uint32_t offset = strings_.size();
+	strings_ += str;
+	return offset;
+}
+
+boost::uint32_t GraphWriter::AddEvents(const EventView& events)
+{
+	boost::uint32_t first = events_.size();
+	events_.insert(events_.end(), events.data, events.data + events.size);
+	return first;
+}
+
+bool GraphWriter::Write(const NamedGenerators& graphs, const string& path)
+{
+	vector<GraphRoot> roots;
+	for (NamedGenerators::const_iterator it = graphs.begin(); it != graphs.end(); it++) {
+		GraphRoot root;
+		if (!Add(it->second.get(), root.node)) {
+			return false;
+		}
+		root.nameOffset = AddString(it->first);
+		root.nameSize = it->first.size();
+		roots.push_back(root);
+	}
+
+	// events go first after the header so they stay aligned whatever the
+	// size of the string area
+	GraphFileHeader header;
+	memcpy(header.magic, GraphFileMagic, sizeof(header.magic));
+	header.byteOrder = GraphFileByteOrder;
+	header.version = GraphFileVersion;
+	header.eventCount = events_.size();
+	header.eventsOffset = sizeof(GraphFileHeader);
+	header.nodeCount = nodes_.size();
+	header.nodesOffset = header.eventsOffset + header.eventCount * sizeof(MusicEvent);
+	header.refCount = refs_.size();
+	header.refsOffset = header.nodesOffset + header.nodeCount * sizeof(GraphNode);
+	header.rootCount = roots.size();
+	header.rootsOffset = header.refsOffset + header.refCount * sizeof(GraphRef);
+	header.stringsSize = strings_.size();
+	header.stringsOffset = header.rootsOffset + header.rootCount * sizeof(GraphRoot);
+
+	ofstream out(path.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!out) {
+		cerr << "Can not open " << path << " for writing" << endl;
+		return false;
+	}
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	if (!events_.empty()) {
+		out.write(reinterpret_cast<const char*>(&events_[0]), events_.size() * sizeof(MusicEvent));
+	}
+	if (!nodes_.empty()) {
+		out.write(reinterpret_cast<const char*>(&nodes_[0]), nodes_.size() * sizeof(GraphNode));
+	}
+	if (!refs_.empty()) {
+		out.write(reinterpret_cast<const char*>(&refs_[0]), refs_.size() * sizeof(GraphRef));
+	}
+	if (!roots.empty()) {
+		out.write(reinterpret_cast<const char*>(&roots[0]), roots.size() * sizeof(GraphRoot));
+	}
+	out.write(strings_.data(), strings_.size());
+	return out.good();
+}
+
+bool SaveGraphs(const NamedGenerators& graphs, const string& path)
+{
+	GraphWriter writer;
+	return writer.Write(graphs, path);
+}
+
+///////////////////////////
+// Graph loading
+///////////////////////////
+
+bool LoadGraphs(const string& path, NamedGenerators& graphs)
+{
+	boost::shared_ptr<MappedGraphFile> mapped;
+	try {
+		mapped.reset(new MappedGraphFile(path.c_str()));
+	}
+	catch (const boost::interprocess::interprocess_exception& e) {
+		cerr << "Can not map " << path << ": " << e.what() << endl;
+		return false;
+	}
+	const char* base = static_cast<const char*>(mapped->region.get_address());
+	boost::uint64_t size = mapped->region.get_size();
+
+	if (size < sizeof(GraphFileHeader)) {
+		cerr << path << " is not a graph file" << endl;
+		return false;
+	}
+	const GraphFileHeader& header = *reinterpret_cast<const GraphFileHeader*>(base);
+	if (memcmp(header.magic, GraphFileMagic, sizeof(header.magic)) != 0 || header.byteOrder != GraphFileByteOrder) {
+		cerr << path << " is not a graph file for this machine" << endl;
+		return false;
+	}
+	if (header.version != GraphFileVersion) {
+		cerr << path << " is version " << header.version << ", expected " << GraphFileVersion << endl;
+		return false;
+	}
+	if (!InFile(size, header.eventsOffset, header.eventCount, sizeof(MusicEvent)) || header.eventsOffset % 4 != 0 ||
+		!InFile(size, header.nodesOffset, header.nodeCount, sizeof(GraphNode)) ||
+		!InFile(size, header.refsOffset, header.refCount, sizeof(GraphRef)) ||
+		!InFile(size, header.rootsOffset, header.rootCount, sizeof(GraphRoot)) ||
+		!InFile(size, header.stringsOffset, header.stringsSize, 1)) {
+		cerr << path << " is truncated or corrupt" << endl;
+		return false;
+	}
+
+	const MusicEvent* events = reinterpret_cast<const MusicEvent*>(base + header.eventsOffset);
+	const GraphNode* nodes = reinterpret_cast<const GraphNode*>(base + header.nodesOffset);
+	const GraphRef* refs = reinterpret_cast<const GraphRef*>(base + header.refsOffset);
+	const GraphRoot* roots = reinterpret_cast<const GraphRoot*>(base + header.rootsOffset);
+	const char* strings = base + header.stringsOffset;
+
+	for (boost::uint32_t i=0; i<header.eventCount; i++) {
+		if (!ValidEvent(events[i])) {
+			cerr << path << ": event " << i << " is corrupt" << endl;
+			return false;
+		}
+	}
+
+	// children always come before their parents, so one pass builds every node
+	vector<GeneratorSharedPtr> gens(header.nodeCount);
+	for (boost::uint32_t i=0; i<header.nodeCount; i++) {
+		const GraphNode& node = nodes[i];
+		if (!InFile(header.refCount, node.firstRef, node.refCount, 1)) {
+			cerr << path << ": node " << i << " is corrupt" << endl;
+			return false;
+		}
+		vector<GeneratorSharedPtr> children;
+		vector<float> weights;
+		bool hasNull = false;
+		for (boost::uint32_t r=0; r<node.refCount; r++) {
+			const GraphRef& ref = refs[node.firstRef + r];
+			if (ref.node != GraphNullNode && ref.node >= i) {
+				cerr << path << ": node " << i << " is corrupt" << endl;
+				return false;
+			}
+			children.push_back(ref.node == GraphNullNode ? GeneratorSharedPtr() : gens[ref.node]);
+			weights.push_back(ref.weight);
+			hasNull = hasNull || !children.back();
+		}
+
+		GeneratorSharedPtr& gen = gens[i];
+		switch (node.type)
+		{
+		case GRAPH_INT:
+			gen.reset(new SingleValueGenerator<int>(static_cast<int>(node.a)));
+			break;
+		case GRAPH_FLOAT:
+		{
+			float value;
+			memcpy(&value, &node.a, sizeof(value));
+			gen.reset(new SingleValueGenerator<float>(value));
+			break;
+		}
+		case GRAPH_STRING:
+			if (InFile(header.stringsSize, node.a, node.b, 1)) {
+				gen.reset(new SingleValueGenerator<string>(string(strings + node.a, node.b)));
+			}
+			break;
+		case GRAPH_PITCH:
+			// the index is looked up in the pitch table without a check, and
+			// ParsePitchSpec never makes one above the midi range
+			if (node.a < static_cast<boost::uint32_t>(PitchTableSize)) {
+				PitchSpec spec;
+				spec.index = static_cast<unsigned short>(node.a);
+				if (GetPitch(spec) < NumMidiPitches) {
+					gen.reset(new SingleValueGenerator<PitchSpec>(spec));
+				}
+			}
+			break;
+		case GRAPH_NOTE:
+			if (children.size() == 3 && !hasNull) {
+				gen.reset(new NoteGenerator(children[0], children[1], children[2]));
+			}
+			break;
+		case GRAPH_REST:
+			if (children.size() == 1 && !hasNull) {
+				gen.reset(new RestGenerator(children[0]));
+			}
+			break;
+		case GRAPH_PATTERN:
+			if (!hasNull) {
+				gen.reset(new PatternGenerator(children, node.a));
+			}
+			break;
+		case GRAPH_STATIC:
+			if (InFile(header.eventCount, node.a, node.b, 1)) {
+				// played in place, the mapping stays open while this is alive
+				gen.reset(new StaticSequenceGenerator(EventView(events + node.a, node.b, mapped)));
+			}
+			break;
+		case GRAPH_WEIGHTED:
+		{
+			vector<WeightedGenerator::WeightedValue> values;
+			bool badWeight = false;
+			for (unsigned long c=0; c<children.size(); c++) {
+				// NaN fails both comparisons
+				badWeight = badWeight || !(weights[c] >= 0);
+				values.push_back(make_pair(children[c], weights[c]));
+			}
+			if (!badWeight) {
+				gen.reset(new WeightedGenerator(values));
+			}
+			break;
+		}
+		case GRAPH_TRANSPOSE:
+			if (children.size() == 2 && !hasNull) {
+				gen.reset(new TransposeGenerator(children[0], children[1], static_cast<int>(node.a)));
+			}
+			break;
+		case GRAPH_QUANTIZE:
+			if (children.size() == 2 && !hasNull) {
+				gen.reset(new QuantizeGenerator(children[0], children[1], static_cast<int>(node.a)));
+			}
+			break;
+		}
+		if (!gen) {
+			cerr << path << ": node " << i << " is corrupt" << endl;
+			return false;
+		}
+	}
+
+	for (boost::uint32_t i=0; i<header.rootCount; i++) {
+		const GraphRoot& root = roots[i];
+		if (root.node >= header.nodeCount || !InFile(header.stringsSize, root.nameOffset, root.nameSize, 1)) {
+			cerr << path << ": graph " << i << " is corrupt" << endl;
+			return false;
+		}
+		graphs[string(strings + root.nameOffset, root.nameSize)] = gens[root.node];
+	}
+	return true;
+}
+
+///////////////////////////
+// Generator saving
+///////////////////////////
+
+bool SaveConstant(GraphWriter& writer, const Value& value, boost::uint32_t& index)
+{
+	if (const int* i = boost::get<int>(&value)) {
+		index = writer.AddNode(GRAPH_INT, static_cast<boost::uint32_t>(*i));
+	}
+	else if (const float* f = boost::get<float>(&value)) {
+		boost::uint32_t bits;
+		memcpy(&bits, f, sizeof(bits));
+		index = writer.AddNode(GRAPH_FLOAT, bits);
+	}
+	else if (const string* str = boost::get<string>(&value)) {
+		index = writer.AddNode(GRAPH_STRING, writer.AddString(*str), str->size());
+	}
+	else if (const PitchSpec* spec = boost::get<PitchSpec>(&value)) {
+		index = writer.AddNode(GRAPH_PITCH, spec->index);
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+// Add every child and collect references to them
+static bool SaveChildren(GraphWriter& writer, const Generator* gen, vector<GraphRef>& refs)
+{
+	vector<Generator*> children;
+	gen->GetChildren(children);
+	for (unsigned long i=0; i<children.size(); i++) {
+		GraphRef ref = { 0, 0 };
+		if (!writer.Add(children[i], ref.node)) {
+			return false;
+		}
+		refs.push_back(ref);
+	}
+	return true;
+}
+
+bool NoteGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	index = writer.AddNode(GRAPH_NOTE, refs);
+	return true;
+}
+
+bool RestGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	index = writer.AddNode(GRAPH_REST, refs);
+	return true;
+}
+
+bool PatternGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	index = writer.AddNode(GRAPH_PATTERN, refs, repeat_);
+	return true;
+}
+
+bool StaticSequenceGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	index = writer.AddNode(GRAPH_STATIC, writer.AddEvents(events_), events_.size);
+	return true;
+}
+
+bool WeightedGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	for (unsigned long i=0; i<refs.size(); i++) {
+		refs[i].weight = values_[i].second;
+	}
+	index = writer.AddNode(GRAPH_WEIGHTED, refs);
+	return true;
+}
+
+bool TransposeGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	index = writer.AddNode(GRAPH_TRANSPOSE, refs, static_cast<boost::uint32_t>(transposeAmount_));
+	return true;
+}
+
+bool QuantizeGenerator::Save(GraphWriter& writer, boost::uint32_t& index) const
+{
+	vector<GraphRef> refs;
+	if (!SaveChildren(writer, this, refs)) {
+		return false;
+	}
+	index = writer.AddNode(GRAPH_QUANTIZE, refs, static_cast<boost::uint32_t>(degrees_));
+	return true;
+}
+
+}
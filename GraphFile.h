@@ -0,0 +1,99 @@
+#ifndef GRAPHFILE_H
+#define GRAPHFILE_H
+
+#include "Music.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Graph files
+///////////////////////////
+// Versioned binary format for generator graphs. A file holds any number of
+// named graphs as one flat table of nodes, children before parents, so a
+// node that is shared by several graphs is only stored once. Frozen event
+// sequences are stored as raw MusicEvent arrays. When a file is loaded it
+// is mapped into memory and static sequences play straight out of the
+// mapping, without being parsed or copied.
+//
+// Files are written in the byte order of the machine that saved them. A
+// file from a machine with a different byte order or from another version
+// of the format is rejected.
+
+const boost::uint32_t GraphFileVersion = 1;
+
+enum GraphNodeType
+{
+	GRAPH_INT,			// a = value
+	GRAPH_FLOAT,		// a = bits of the value
+	GRAPH_STRING,		// a = offset in the string area, b = length
+	GRAPH_PITCH,		// a = pitch table index
+	GRAPH_NOTE,			// refs = pitch, velocity, length
+	GRAPH_REST,			// refs = length
+	GRAPH_PATTERN,		// refs = items, a = repeat
+	GRAPH_STATIC,		// a = first event, b = number of events
+	GRAPH_WEIGHTED,		// refs = values with their weights
+	GRAPH_TRANSPOSE,	// refs = generator, scale, a = transpose amount
+	GRAPH_QUANTIZE		// refs = generator, scale, a = degrees
+};
+
+// Index of a missing child
+const boost::uint32_t GraphNullNode = 0xFFFFFFFF;
+
+// Records as they are laid out in the file
+struct GraphNode
+{
+	boost::uint32_t type;
+	boost::uint32_t firstRef;
+	boost::uint32_t refCount;
+	boost::uint32_t a;
+	boost::uint32_t b;
+};
+
+struct GraphRef
+{
+	boost::uint32_t node;
+	float weight;
+};
+
+typedef std::map<std::string, GeneratorSharedPtr> NamedGenerators;
+
+// Write graphs to a file. Returns false if a generator in one of them can
+// not be saved or the file can not be written.
+bool SaveGraphs(const NamedGenerators& graphs, const std::string& path);
+
+// Map a file written by SaveGraphs and rebuild its graphs. The file stays
+// mapped for as long as any static sequence loaded from it is alive.
+bool LoadGraphs(const std::string& path, NamedGenerators& graphs);
+
+///////////////////////////
+// Graph writer
+///////////////////////////
+// Collects the nodes of a file. Generators add themselves through
+// Generator::Save.
+class GraphWriter
+{
+public:
+	// Add gen and everything under it, unless it is already in the file
+	bool Add(const Generator* gen, boost::uint32_t& index);
+
+	boost::uint32_t AddNode(GraphNodeType type, const std::vector<GraphRef>& refs, boost::uint32_t a = 0, boost::uint32_t b = 0);
+	boost::uint32_t AddNode(GraphNodeType type, boost::uint32_t a = 0, boost::uint32_t b = 0);
+	// Returns the offset of the string in the string area
+	boost::uint32_t AddString(const std::string& str);
+	// Returns the index of the first event
+	boost::uint32_t AddEvents(const EventView& events);
+
+	bool Write(const NamedGenerators& graphs, const std::string& path);
+
+private:
+	std::map<const Generator*, boost::uint32_t> indices_;
+	std::vector<GraphNode> nodes_;
+	std::vector<GraphRef> refs_;
+	std::vector<MusicEvent> events_;
+	std::string strings_;
+};
+
+}
+
+#endif
@@ -1,6 +1,9 @@
 
 #include "JSFuncs.h"
 #include "Music.h"
+#include "TaskPool.h"
+#include "GraphFile.h"
+#include "Optimize.h"
 #include "Plugin.h"
 #include "Audio.h"
 #include <assert.h>
@@ -16,6 +19,11 @@ list<boost::shared_ptr<SongTrack> > gTracks;
 
 list<boost::shared_ptr<SongTrack> >& GetTracks() { return gTracks; }
 
+// song clock shared by every track
+Music::Transport gTransport(AUDIO_SAMPLE_RATE);
+
+Music::Transport& GetTransport() { return gTransport; }
+
 extern HINSTANCE gHinstance;
 extern int gCmdShow;
 
@@ -25,6 +33,7 @@ static Persistent<ObjectTemplate> gRestTemplate;
 static Persistent<ObjectTemplate> gPatternTemplate;
 static Persistent<ObjectTemplate> gWeightedGenTemplate;
 static Persistent<ObjectTemplate> gTransposeGenTemplate;
+static Persistent<ObjectTemplate> gQuantizeGenTemplate;
 static Persistent<ObjectTemplate> gTrackTemplate;
 v8::Handle<v8::Value> MakeNote(const v8::Arguments& args);
 Handle<ObjectTemplate> MakeNoteTemplate();
@@ -38,7 +47,17 @@ v8::Handle<v8::Value> MakeTrack(const v8::Arguments& args);
 Handle<ObjectTemplate> MakeTrackTemplate();
 v8::Handle<v8::Value> MakeTransposeGen(const v8::Arguments& args);
 Handle<ObjectTemplate> MakeTransposeGenTemplate();
+v8::Handle<v8::Value> MakeQuantizeGen(const v8::Arguments& args);
+Handle<ObjectTemplate> MakeQuantizeGenTemplate();
 //Handle<Value> GetPitch(Local<String> name, const AccessorInfo& info);
+v8::Handle<v8::Value> SetProfiling(const v8::Arguments& args);
+v8::Handle<v8::Value> GetPoolStats(const v8::Arguments& args);
+v8::Handle<v8::Value> SetTimeSignature(const v8::Arguments& args);
+v8::Handle<v8::Value> SetTempo(const v8::Arguments& args);
+v8::Handle<v8::Value> GetPosition(const v8::Arguments& args);
+v8::Handle<v8::Value> SaveGraphs(const v8::Arguments& args);
+v8::Handle<v8::Value> LoadGraphs(const v8::Arguments& args);
+void AddGeneratorMethods(Handle<ObjectTemplate> templ);
 
 typedef boost::variant<boost::shared_ptr<Music::Generator>, boost::shared_ptr<SongTrack> > MusicObject;
 
@@ -55,7 +74,15 @@ Persistent<Context> CreateV8Context()
 	global->Set(v8::String::New("PatternGen"), v8::FunctionTemplate::New(MakePattern));
 	global->Set(v8::String::New("WeightGen"), v8::FunctionTemplate::New(MakeWeightedGen));
 	global->Set(v8::String::New("TransposeGen"), v8::FunctionTemplate::New(MakeTransposeGen));
+	global->Set(v8::String::New("QuantizeGen"), v8::FunctionTemplate::New(MakeQuantizeGen));
 	global->Set(v8::String::New("Track"), v8::FunctionTemplate::New(MakeTrack));
+	global->Set(v8::String::New("Profile"), v8::FunctionTemplate::New(SetProfiling));
+	global->Set(v8::String::New("PoolStats"), v8::FunctionTemplate::New(GetPoolStats));
+	global->Set(v8::String::New("TimeSignature"), v8::FunctionTemplate::New(SetTimeSignature));
+	global->Set(v8::String::New("Tempo"), v8::FunctionTemplate::New(SetTempo));
+	global->Set(v8::String::New("Position"), v8::FunctionTemplate::New(GetPosition));
+	global->Set(v8::String::New("Save"), v8::FunctionTemplate::New(SaveGraphs));
+	global->Set(v8::String::New("Load"), v8::FunctionTemplate::New(LoadGraphs));
 	
 	v8::Persistent<v8::Context> context = v8::Context::New(NULL, global);
 
@@ -191,13 +218,26 @@ void ReportException(v8::TryCatch* try_catch) {
   }
 }
 
+/**
+ * Pitch strings are resolved into a pitch spec once, when the generator is
+ * built, instead of being parsed every time a note is generated.
+ */
+Music::GeneratorSharedPtr MakePitchGenerator(const string& pitchStr)
+{
+	Music::PitchSpec spec;
+	if (Music::ParsePitchSpec(pitchStr, spec)) {
+		return Music::GeneratorSharedPtr(new Music::SingleValueGenerator<Music::PitchSpec>(spec));
+	}
+	return Music::GeneratorSharedPtr(new Music::SingleValueGenerator<string>(pitchStr));
+}
+
 Music::GeneratorSharedPtr GetGeneratorFromJSValue(Handle<Value> value, bool interpretIntAsFloat)
 {
 	Music::GeneratorSharedPtr gen;
 	if (value->IsString()) {
 		v8::String::Utf8Value str(value);
 		string pitchStr = string(ToCString(str));
-		gen.reset(new Music::SingleValueGenerator<string>(pitchStr));
+		gen = MakePitchGenerator(pitchStr);
 	}
 	else if (value->IsUint32() || value->IsInt32()) {
 		int val = value->Int32Value();
@@ -219,8 +259,6 @@ Music::GeneratorSharedPtr GetGeneratorFromJSValue(Handle<Value> value, bool inte
 	return gen;
 }
 
-unsigned long WEIGHT_SCALE = 1000;
-
 Handle<Value> MakeNote(const Arguments& args) {
 	HandleScope handle_scope;
 
@@ -238,7 +276,7 @@ Handle<Value> MakeNote(const Arguments& args) {
 	if (arg->IsString()) {
 		v8::String::Utf8Value str(arg);
 		string pitchStr = string(ToCString(str));
-		pitchGen.reset(new Music::SingleValueGenerator<string>(pitchStr));
+		pitchGen = MakePitchGenerator(pitchStr);
 	}
 	else if (arg->IsObject()) {
 		MusicObject* obj = ExtractObjectFromJSWrapper<MusicObject>(arg->ToObject());
@@ -301,11 +339,77 @@ Handle<Value> MakeNote(const Arguments& args) {
 	return handle_scope.Close(result);
 }
 
+// Setters edit a generator in place. Patterns that use it pick up the change
+// the next time they are frozen or loop.
+template <class T>
+boost::shared_ptr<T> GetHolderAs(const v8::Arguments& args, const char* method)
+{
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	Music::GeneratorSharedPtr* gen = boost::get<Music::GeneratorSharedPtr>(holder);
+	boost::shared_ptr<T> result;
+	if (gen) {
+		result = boost::dynamic_pointer_cast<T>(*gen);
+	}
+	if (!result) {
+		cerr << "this object of " << method << " can not be edited this way!" << endl;
+	}
+	return result;
+}
+
+v8::Handle<v8::Value> setNotePitch(const v8::Arguments& args)
+{
+	Music::NoteGenSharedPtr note = GetHolderAs<Music::NoteGenerator>(args, "SetPitch");
+	if (note && args.Length() > 0) {
+		note->SetPitch(GetGeneratorFromJSValue(args[0], false));
+	}
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> setNoteVelocity(const v8::Arguments& args)
+{
+	Music::NoteGenSharedPtr note = GetHolderAs<Music::NoteGenerator>(args, "SetVelocity");
+	if (note && args.Length() > 0) {
+		note->SetVelocity(GetGeneratorFromJSValue(args[0], false));
+	}
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> setNoteLength(const v8::Arguments& args)
+{
+	Music::NoteGenSharedPtr note = GetHolderAs<Music::NoteGenerator>(args, "SetLength");
+	if (note && args.Length() > 0) {
+		note->SetLength(GetGeneratorFromJSValue(args[0], true));
+	}
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> setRestLength(const v8::Arguments& args)
+{
+	Music::RestGenSharedPtr rest = GetHolderAs<Music::RestGenerator>(args, "SetLength");
+	if (rest && args.Length() > 0) {
+		rest->SetLength(GetGeneratorFromJSValue(args[0], true));
+	}
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> setPatternRepeat(const v8::Arguments& args)
+{
+	Music::PatternGenSharedPtr pattern = GetHolderAs<Music::PatternGenerator>(args, "SetRepeat");
+	if (pattern && args.Length() > 0) {
+		pattern->SetRepeat(args[0]->Uint32Value());
+	}
+	return v8::Undefined();
+}
+
 Handle<ObjectTemplate> MakeNoteTemplate() {
 	HandleScope handle_scope;
 
 	Handle<ObjectTemplate> result = ObjectTemplate::New();
 	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
+	result->Set(v8::String::New("SetPitch"), v8::FunctionTemplate::New(setNotePitch));
+	result->Set(v8::String::New("SetVelocity"), v8::FunctionTemplate::New(setNoteVelocity));
+	result->Set(v8::String::New("SetLength"), v8::FunctionTemplate::New(setNoteLength));
 
 	// Add accessors for each of the fields of the request.
 	//result->SetAccessor(String::NewSymbol("pitch"), GetPitch);
@@ -331,6 +435,8 @@ Handle<ObjectTemplate> MakeRestTemplate() {
 
 	Handle<ObjectTemplate> result = ObjectTemplate::New();
 	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
+	result->Set(v8::String::New("SetLength"), v8::FunctionTemplate::New(setRestLength));
 
 	// Add accessors for each of the fields of the request.
 
@@ -385,6 +491,9 @@ Handle<Value> MakeRest(const Arguments& args)
 	return handle_scope.Close(result); 
 }
 
+// largest pattern MakeStatic will generate
+const boost::uint64_t MaxStaticBytes = 256 * 1024 * 1024;
+
 v8::Handle<v8::Value> makeStaticPattern(const v8::Arguments& args) 
 {
 	HandleScope scope;
@@ -395,13 +504,31 @@ v8::Handle<v8::Value> makeStaticPattern(const v8::Arguments& args)
 		cerr << "this object of MakeStatic is not a generator!" << endl;
 		return v8::Undefined();
 	}
-	Music::PatternGenerator* patGen = dynamic_cast<Music::PatternGenerator*>(gen->get());
-	if (!patGen) {
-		cerr << "this object of MakeStatic is not a pattern generator!" << endl;
+	// an optional seed makes the frozen pattern reproducible
+	Music::RandomStream random(Music::GetClockSeed());
+	if (args.Length() > 0 && args[0]->IsNumber()) {
+		random = Music::RandomStream(args[0]->IntegerValue());
+	}
+	// with shared randomness every use of a reused random subgraph gets the same result
+	bool sharedRandomness = args.Length() > 1 && args[1]->BooleanValue();
+	// refuse to freeze graphs that would not fit in memory, they can still
+	// be played since tracks stream long patterns
+	boost::uint64_t bytes = Music::EstimateBytes(gen->get());
+	if (bytes > MaxStaticBytes) {
+		cerr << "MakeStatic: pattern is too long to freeze (";
+		if (bytes == Music::NoEventCount) {
+			cerr << "unknown size";
+		}
+		else {
+			cerr << bytes / (1024 * 1024) << " MB";
+		}
+		cerr << "), play it instead" << endl;
 		return v8::Undefined();
 	}
-
-	Music::PatternGenSharedPtr newPatGen = patGen->MakeStatic();
+	// large patterns are generated on the worker pool, the result is the same
+	// as generating on this thread. freezing again after an edit only
+	// regenerates the parts of the graph the edit touched.
+	Music::GeneratorSharedPtr newPatGen = (*gen)->MakeStatic(random, sharedRandomness, &Music::GetGenerationPool(), true);
 
 	// TODO: Move this boilerplate code below into a function
 
@@ -431,14 +558,202 @@ v8::Handle<v8::Value> makeStaticPattern(const v8::Arguments& args)
 	return scope.Close(result);
 }
 
+// Profile(true) turns on the per generator counters, Profile(false) turns them off
+v8::Handle<v8::Value> SetProfiling(const v8::Arguments& args)
+{
+	Music::SetProfiling(args.Length() == 0 || args[0]->BooleanValue());
+	return v8::Undefined();
+}
+
+// PoolStats() reports how the small object pool behind generation is used
+v8::Handle<v8::Value> GetPoolStats(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	Music::PoolStats stats = Music::GetPoolStats();
+	Handle<Object> result = v8::Object::New();
+	result->Set(v8::String::New("allocations"), v8::Number::New(static_cast<double>(stats.allocations)));
+	result->Set(v8::String::New("frees"), v8::Number::New(static_cast<double>(stats.frees)));
+	result->Set(v8::String::New("inUse"), v8::Number::New(static_cast<double>(stats.allocations - stats.frees)));
+	result->Set(v8::String::New("largeAllocations"), v8::Number::New(static_cast<double>(stats.largeAllocations)));
+	result->Set(v8::String::New("allocatedBytes"), v8::Number::New(static_cast<double>(stats.allocatedBytes)));
+	result->Set(v8::String::New("slabs"), v8::Number::New(static_cast<double>(stats.slabs)));
+	result->Set(v8::String::New("bytes"), v8::Number::New(static_cast<double>(stats.slabBytes)));
+	return scope.Close(result);
+}
+
+// TimeSignature(beats) sets the number of beats in a bar of the transport,
+// from the next bar line on
+v8::Handle<v8::Value> SetTimeSignature(const v8::Arguments& args)
+{
+	if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 1) {
+		cerr << "TimeSignature requires a number of beats" << endl;
+		return v8::Undefined();
+	}
+	gTransport.SetBeatsPerBar(static_cast<long>(args[0]->IntegerValue()));
+	return v8::Undefined();
+}
+
+// Tempo(bpm) changes the tempo on the next beat, Tempo(bpm, beats) ramps
+// to it over that many beats
+v8::Handle<v8::Value> SetTempo(const v8::Arguments& args)
+{
+	if (args.Length() < 1 || !args[0]->IsNumber() || !(args[0]->NumberValue() > 0)) {
+		cerr << "Tempo requires beats per minute" << endl;
+		return v8::Undefined();
+	}
+	double rampBeats = 0;
+	if (args.Length() > 1 && args[1]->IsNumber()) {
+		rampBeats = args[1]->NumberValue();
+	}
+	gTransport.SetTempo(args[0]->NumberValue(), rampBeats);
+	return v8::Undefined();
+}
+
+// Position() reports where the transport is, as a bar and a beat within it
+// counted from 0, and as a sample frame
+v8::Handle<v8::Value> GetPosition(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	const Music::TempoMap& map = gTransport.GetTempoMap();
+	Music::SampleTime sample = gTransport.GetPosition();
+	Music::Ticks ticks = map.ToTicks(sample);
+	Music::Ticks intoBar;
+	long bar = map.GetBar(ticks, intoBar);
+	Handle<Object> result = v8::Object::New();
+	result->Set(v8::String::New("bar"), v8::Number::New(static_cast<double>(bar)));
+	result->Set(v8::String::New("beat"), v8::Number::New(static_cast<double>(intoBar) / Music::TicksPerBeat));
+	result->Set(v8::String::New("sample"), v8::Number::New(static_cast<double>(sample)));
+	result->Set(v8::String::New("bpm"), v8::Number::New(map.GetBpm(ticks)));
+	return scope.Close(result);
+}
+
+v8::Handle<v8::Value> getGeneratorStats(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	Music::GeneratorSharedPtr* gen = boost::get<Music::GeneratorSharedPtr>(holder);
+	if (!gen) {
+		cerr << "this object of Stats is not a generator!" << endl;
+		return v8::Undefined();
+	}
+	Music::GeneratorStats stats = (*gen)->GetStats();
+	Handle<Object> result = v8::Object::New();
+	result->Set(v8::String::New("name"), v8::String::New((*gen)->Name()));
+	result->Set(v8::String::New("calls"), v8::Number::New(static_cast<double>(stats.calls)));
+	result->Set(v8::String::New("events"), v8::Number::New(static_cast<double>(stats.items)));
+	result->Set(v8::String::New("time"), v8::Number::New(Music::ProfileTicksToMilliseconds(stats.ticks)));
+	result->Set(v8::String::New("allocatedBytes"), v8::Number::New(static_cast<double>(stats.allocatedBytes)));
+	return scope.Close(result);
+}
+
+v8::Handle<v8::Value> dumpGeneratorStats(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	Music::GeneratorSharedPtr* gen = boost::get<Music::GeneratorSharedPtr>(holder);
+	if (!gen) {
+		cerr << "this object of DumpStats is not a generator!" << endl;
+		return v8::Undefined();
+	}
+	std::ostringstream out;
+	Music::DumpStats(gen->get(), out);
+	return scope.Close(v8::String::New(out.str().c_str()));
+}
+
+v8::Handle<v8::Value> resetGeneratorStats(const v8::Arguments& args)
+{
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	Music::GeneratorSharedPtr* gen = boost::get<Music::GeneratorSharedPtr>(holder);
+	if (!gen) {
+		cerr << "this object of ResetStats is not a generator!" << endl;
+		return v8::Undefined();
+	}
+	Music::ResetStats(gen->get());
+	return v8::Undefined();
+}
+
+// Save("song.bin", {lead: p1, bass: p2}) writes every generator in the object to a file
+v8::Handle<v8::Value> SaveGraphs(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsObject()) {
+		cerr << "Save takes a file name and an object of generators" << endl;
+		return v8::False();
+	}
+	v8::String::Utf8Value path(args[0]);
+	Handle<Object> object = args[1]->ToObject();
+
+	Music::NamedGenerators graphs;
+	Local<Array> names = object->GetOwnPropertyNames();
+	for (unsigned int i=0; i<names->Length(); i++) {
+		Local<Value> name = names->Get(i);
+		Local<Value> value = object->Get(name);
+		if (!value->IsObject() || value->ToObject()->InternalFieldCount() != 1) {
+			continue;
+		}
+		MusicObject* musicObj = ExtractObjectFromJSWrapper<MusicObject>(value->ToObject());
+		Music::GeneratorSharedPtr* gen = boost::get<Music::GeneratorSharedPtr>(musicObj);
+		if (gen) {
+			v8::String::Utf8Value nameStr(name);
+			graphs[ToCString(nameStr)] = *gen;
+		}
+	}
+	return scope.Close(v8::Boolean::New(Music::SaveGraphs(graphs, ToCString(path))));
+}
+
+// Load("song.bin") returns an object with every generator saved in the file
+v8::Handle<v8::Value> LoadGraphs(const v8::Arguments& args)
+{
+	HandleScope scope;
+
+	if (args.Length() != 1 || !args[0]->IsString()) {
+		cerr << "Load takes a file name" << endl;
+		return v8::Undefined();
+	}
+	v8::String::Utf8Value path(args[0]);
+	Music::NamedGenerators graphs;
+	if (!Music::LoadGraphs(ToCString(path), graphs)) {
+		return v8::Undefined();
+	}
+
+	if (gPatternTemplate.IsEmpty()) {
+		Handle<ObjectTemplate> raw_template = MakePatternTemplate();
+		gPatternTemplate = Persistent<ObjectTemplate>::New(raw_template);
+	}
+	Handle<Object> result = v8::Object::New();
+	for (Music::NamedGenerators::iterator it = graphs.begin(); it != graphs.end(); it++) {
+		// loaded generators all get the pattern methods
+		Handle<Object> wrapper = gPatternTemplate->NewInstance();
+		MusicObject* obj = new MusicObject(it->second);
+		wrapper->SetInternalField(0, External::New(obj));
+		result->Set(v8::String::New(it->first.c_str()), wrapper);
+	}
+	return scope.Close(result);
+}
+
+// Methods every generator object has
+void AddGeneratorMethods(Handle<ObjectTemplate> templ)
+{
+	templ->Set(v8::String::New("Stats"), v8::FunctionTemplate::New(getGeneratorStats));
+	templ->Set(v8::String::New("DumpStats"), v8::FunctionTemplate::New(dumpGeneratorStats));
+	templ->Set(v8::String::New("ResetStats"), v8::FunctionTemplate::New(resetGeneratorStats));
+}
+
 Handle<ObjectTemplate> MakePatternTemplate() {
 	HandleScope handle_scope;
 
 	Handle<ObjectTemplate> result = ObjectTemplate::New();
 	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
 
 	// Add accessors for each of the fields
 	result->Set(v8::String::New("MakeStatic"), v8::FunctionTemplate::New(makeStaticPattern));
+	result->Set(v8::String::New("SetRepeat"), v8::FunctionTemplate::New(setPatternRepeat));
 
 	// Again, return the result through the current handle scope.
 	return handle_scope.Close(result);
@@ -504,7 +819,29 @@ v8::Handle<v8::Value> addPatternToTrack(const v8::Arguments& args)
 	holder = ExtractObjectFromJSWrapper<MusicObject>(args[0]->ToObject());
 	Music::GeneratorSharedPtr patternGen = boost::get<Music::GeneratorSharedPtr>(*holder);
 	
-	track->track->Add(patternGen, Music::BAR);
+	// an optional second argument starts the pattern that many beats in
+	double startBeat = 0;
+	if (args.Length() > 1 && args[1]->IsNumber()) {
+		startBeat = args[1]->NumberValue();
+	}
+	// and a third one says where it starts: "bar" (the default), "beat" or "now"
+	Music::Quantization quantize = Music::BAR;
+	if (args.Length() > 2 && args[2]->IsString()) {
+		v8::String::Utf8Value launchStr(args[2]);
+		string launch = ToCString(launchStr);
+		if (launch == "beat") {
+			quantize = Music::BEAT;
+		}
+		else if (launch == "now") {
+			quantize = Music::NONE;
+		}
+		else if (launch != "bar") {
+			cerr << "Play starts on \"bar\", \"beat\" or \"now\", not " << launch << endl;
+		}
+	}
+	if (!track->track->Add(patternGen, quantize, startBeat)) {
+		cerr << "Play failed, the track is full" << endl;
+	}
 
 	return v8::Undefined();
 }
@@ -519,7 +856,9 @@ v8::Handle<v8::Value> removePatternFromTrack(const v8::Arguments& args)
 	holder = ExtractObjectFromJSWrapper<MusicObject>(args[0]->ToObject());
 	Music::GeneratorSharedPtr patternGen = boost::get<Music::GeneratorSharedPtr>(*holder);
 	
-	track->track->Remove(patternGen);
+	if (!track->track->Remove(patternGen)) {
+		cerr << "Remove failed, the track is busy" << endl;
+	}
 
 	return v8::Undefined();
 }
@@ -531,7 +870,61 @@ v8::Handle<v8::Value> clearTrack(const v8::Arguments& args)
 	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
 	boost::shared_ptr<SongTrack> track = boost::get< boost::shared_ptr<SongTrack> >(*holder);
 	
-	track->track->Clear();
+	if (!track->track->Clear()) {
+		cerr << "Clear failed, the track is busy" << endl;
+	}
+
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> seekTrack(const v8::Arguments& args) 
+{
+	HandleScope scope;
+
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	boost::shared_ptr<SongTrack> track = boost::get< boost::shared_ptr<SongTrack> >(*holder);
+
+	if (args.Length() < 1 || !args[0]->IsNumber()) {
+		cerr << "Seek requires a beat" << endl;
+		return v8::Undefined();
+	}
+	if (!track->track->Seek(args[0]->NumberValue())) {
+		cerr << "Seek failed, the track is busy" << endl;
+	}
+
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> setTrackTempoScale(const v8::Arguments& args) 
+{
+	HandleScope scope;
+
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	boost::shared_ptr<SongTrack> track = boost::get< boost::shared_ptr<SongTrack> >(*holder);
+
+	if (args.Length() < 1 || !args[0]->IsNumber() || !(args[0]->NumberValue() > 0)) {
+		cerr << "TempoScale requires a positive number" << endl;
+		return v8::Undefined();
+	}
+	if (!track->track->SetTempoScale(args[0]->NumberValue())) {
+		cerr << "TempoScale failed, the track is busy" << endl;
+	}
+
+	return v8::Undefined();
+}
+
+v8::Handle<v8::Value> seedTrack(const v8::Arguments& args) 
+{
+	HandleScope scope;
+
+	MusicObject* holder = ExtractObjectFromJSWrapper<MusicObject>(args.Holder());
+	boost::shared_ptr<SongTrack> track = boost::get< boost::shared_ptr<SongTrack> >(*holder);
+
+	if (args.Length() < 1 || !args[0]->IsNumber()) {
+		cerr << "Seed requires a number" << endl;
+		return v8::Undefined();
+	}
+	track->track->Seed(args[0]->IntegerValue());
 
 	return v8::Undefined();
 }
@@ -541,6 +934,7 @@ Handle<ObjectTemplate> MakeWeightedGenTemplate() {
 
 	Handle<ObjectTemplate> result = ObjectTemplate::New();
 	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
 
 	// Add accessors
 
@@ -565,8 +959,7 @@ Handle<Value> MakeWeightedGen(const Arguments& args) {
 				Local<Value> weightValue = arr->Get(1);
 				if (weightValue->IsNumber()) {
 					float weight = static_cast<float>(weightValue->NumberValue());
-					int scaledWeight = weight * WEIGHT_SCALE;
-					gens.push_back( make_pair(genPtr, scaledWeight) );
+					gens.push_back( make_pair(genPtr, weight) );
 				}
 			}
 		}
@@ -605,6 +998,7 @@ Handle<ObjectTemplate> MakeTransposeGenTemplate() {
 
 	Handle<ObjectTemplate> result = ObjectTemplate::New();
 	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
 
 	// Add accessors
 
@@ -674,6 +1068,69 @@ Handle<Value> MakeTransposeGen(const Arguments& args) {
 	return handle_scope.Close(result);
 }
 
+Handle<ObjectTemplate> MakeQuantizeGenTemplate() {
+	HandleScope handle_scope;
+
+	Handle<ObjectTemplate> result = ObjectTemplate::New();
+	result->SetInternalFieldCount(1);
+	AddGeneratorMethods(result);
+
+	// Again, return the result through the current handle scope.
+	return handle_scope.Close(result);
+}
+
+// QuantizeGen(gen, "C_MAJ") snaps every note of gen onto the scale.
+// An optional third argument then moves the notes that many scale degrees.
+Handle<Value> MakeQuantizeGen(const Arguments& args) {
+	HandleScope handle_scope;
+
+	if (args.Length() < 2 || args.Length() > 3) {
+		cerr << "Incorrect number of arguments to QuantizeGen (2 or 3 required)" << endl;
+		return Handle<Value>();
+	}
+
+	Local<Value> arg = args[0];
+	if (!arg->IsObject())
+	{
+		cerr << "First argument to QuantizeGen must be a generator!" << endl;
+		return Handle<Value>();
+	}
+	MusicObject* musicObj = ExtractObjectFromJSWrapper<MusicObject>(arg->ToObject());
+	Music::GeneratorSharedPtr gen = boost::get<Music::GeneratorSharedPtr>(*musicObj);
+
+	arg = args[1];
+	if (!arg->IsString()) {
+		cerr << "Second argument to QuantizeGen must be a scale string!" << endl;
+		return Handle<Value>();
+	}
+	v8::String::Utf8Value str(arg);
+	string scaleStr = string(ToCString(str));
+	Music::GeneratorSharedPtr scaleGen(new Music::SingleValueGenerator<string>(scaleStr));
+
+	int degrees = 0;
+	if (args.Length() > 2) {
+		if (!args[2]->IsNumber()) {
+			cerr << "Third argument to QuantizeGen must be an integer!" << endl;
+			return Handle<Value>();
+		}
+		degrees = args[2]->Int32Value();
+	}
+
+	boost::shared_ptr<Music::QuantizeGenerator> quantizeGen( new Music::QuantizeGenerator(gen, scaleGen, degrees) );
+
+	if (gQuantizeGenTemplate.IsEmpty()) {
+		Handle<ObjectTemplate> raw_template = MakeQuantizeGenTemplate();
+		gQuantizeGenTemplate = Persistent<ObjectTemplate>::New(raw_template);
+	}
+	Handle<Object> result = gQuantizeGenTemplate->NewInstance();
+
+	MusicObject* obj = new MusicObject(quantizeGen);
+	Handle<External> ptr = External::New(obj);
+	result->SetInternalField(0, ptr);
+
+	return handle_scope.Close(result);
+}
+
 Handle<ObjectTemplate> MakeTrackTemplate() {
 	HandleScope handle_scope;
 
@@ -684,6 +1141,9 @@ Handle<ObjectTemplate> MakeTrackTemplate() {
 	result->Set(v8::String::New("Play"), v8::FunctionTemplate::New(addPatternToTrack));
 	result->Set(v8::String::New("Remove"), v8::FunctionTemplate::New(removePatternFromTrack));
 	result->Set(v8::String::New("Clear"), v8::FunctionTemplate::New(clearTrack));
+	result->Set(v8::String::New("Seed"), v8::FunctionTemplate::New(seedTrack));
+	result->Set(v8::String::New("Seek"), v8::FunctionTemplate::New(seekTrack));
+	result->Set(v8::String::New("TempoScale"), v8::FunctionTemplate::New(setTrackTempoScale));
 
 	// Again, return the result through the current handle scope.
 	return handle_scope.Close(result);
@@ -714,7 +1174,7 @@ Handle<Value> MakeTrack(const Arguments& args)
 	songTrack->plugin = new Plugin(AUDIO_SAMPLE_RATE, AUDIO_FRAMES_PER_BUFFER);
 	songTrack->plugin->Load(pluginPath, presetName);
 	songTrack->plugin->Show(gHinstance, gCmdShow);
-	songTrack->track = new Music::Track;
+	songTrack->track = new Music::Track(gTransport);
 	songTrack->volume = volume;
 	gTracks.push_back(songTrack);
 
@@ -5,7 +5,7 @@
 #include <list>
 #include <boost/shared_ptr.hpp>
 
-namespace Music { class Track; }
+namespace Music { class Track; class Transport; }
 class Plugin;
 
 struct SongTrack
@@ -16,6 +16,7 @@ struct SongTrack
 };
 
 std::list<boost::shared_ptr<SongTrack> >& GetTracks();
+Music::Transport& GetTransport();
 
 v8::Persistent<v8::Context> CreateV8Context();
 bool ExecuteString(v8::Handle<v8::String> source,
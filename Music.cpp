@@ -1,4 +1,24 @@
 #include "Music.h"
+#include "Program.h"
+#include "Optimize.h"
+#include "TaskPool.h"
+#include "Atomic.h"
+#include "Transform.h"
+#include <boost/static_assert.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <iomanip>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 using namespace std;
 using namespace boost;
@@ -6,10 +26,7 @@ using namespace boost;
 namespace Music
 {
 
-float BPM = 120;
-float BEAT_LENGTH = 1 / BPM * 60000;
-
-static bool randSeeded = false;
+BOOST_STATIC_ASSERT(sizeof(MusicEvent) == 8);
 
 const string ScaleStrings[NumScales] = 
 {
@@ -53,17 +70,348 @@ unsigned short GetPitchNumberFromName(string PitchName)
 
 unsigned short GetMidiPitch(Scale scale, int root, int octave, int degree)
 {
-	const ScaleInfo* info = &scaleInfo[scale];
 	short midiPitch = 12 * octave + root;
+	if (scale >= NumScales) {
+		return midiPitch;
+	}
+	const ScaleInfo* info = &scaleInfo[scale];
 	if (degree >= 1 && degree <= info->numIntervals) {
 		midiPitch += info->intervals[degree-1];
 	}
 	return midiPitch;
 }
 
-float BeatsToMilliseconds(float beats)
+static short pitchTable[PitchTableSize];
+
+static unsigned short GetPitchTableIndex(Scale scale, int root, int octave, int degree)
+{
+	return static_cast<unsigned short>(((scale * 12 + root) * NumPitchOctaves + octave) * NumPitchDegrees + degree);
+}
+
+static bool BuildPitchTable()
+{
+	for (int scale=0; scale<NumScales; scale++) {
+		for (int root=0; root<12; root++) {
+			for (int octave=0; octave<NumPitchOctaves; octave++) {
+				for (int degree=0; degree<NumPitchDegrees; degree++) {
+					pitchTable[GetPitchTableIndex((Scale)scale, root, octave, degree)] = GetMidiPitch((Scale)scale, root, octave, degree);
+				}
+			}
+		}
+	}
+	return true;
+}
+// VS2010 has neither constexpr nor thread safe local statics, so the table
+// is filled in while this file's statics are initialized, before main and
+// before any thread can look a pitch up
+static bool pitchTableBuilt = BuildPitchTable();
+
+short GetPitch(PitchSpec spec)
+{
+	return pitchTable[spec.index];
+}
+
+///////////////////////////
+// Timeline
+///////////////////////////
+
+Ticks BeatsToTicks(double beats)
+{
+	return static_cast<Ticks>(floor(beats * TicksPerBeat + 0.5));
+}
+
+namespace
+{
+
+boost::int64_t GreatestCommonDivisor(boost::int64_t a, boost::int64_t b)
+{
+	while (b != 0) {
+		boost::int64_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+}
+
+TickRate::TickRate(unsigned long sampleRate, double bpm)
+{
+	// sampleRate * 60 / (bpm * TicksPerBeat) with bpm in thousandths.
+	// 60000 and TicksPerBeat share a factor of 480, which keeps both terms
+	// well below 2^32 for any sensible rate and tempo.
+	boost::int64_t milliBpm = std::max(static_cast<boost::int64_t>(floor(bpm * 1000 + 0.5)), static_cast<boost::int64_t>(1));
+	num_ = static_cast<boost::int64_t>(sampleRate) * 60000;
+	den_ = milliBpm * TicksPerBeat;
+	boost::int64_t divisor = GreatestCommonDivisor(num_, den_);
+	num_ /= divisor;
+	den_ /= divisor;
+}
+
+SampleTime TickRate::ToSamples(Ticks ticks) const
+{
+	// whole multiples of den_ first, so the products can not overflow
+	Ticks rest = ticks % den_;
+	return ticks / den_ * num_ + (rest * num_ + den_ - 1) / den_;
+}
+
+Ticks TickRate::ToTicks(SampleTime samples) const
+{
+	if (samples <= 0) {
+		return 0;
+	}
+	// the smallest t with ceil(t * num_ / den_) >= samples
+	SampleTime before = samples - 1;
+	SampleTime rest = before % num_;
+	return before / num_ * den_ + rest * den_ / num_ + 1;
+}
+
+///////////////////////////
+// Tempo map
+///////////////////////////
+
+TempoMap::TempoMap(unsigned long sampleRate, double bpm) : sampleRate_(sampleRate)
+{
+	segments_.push_back(Segment(0, 0, sampleRate, bpm, bpm, 0));
+	meters_.push_back(Meter(0, 0, DefaultBeatsPerBar));
+}
+
+void TempoMap::SetTempo(Ticks tick, double bpm, Ticks rampTicks)
+{
+	tick = std::max(tick, static_cast<Ticks>(0));
+	bpm = std::max(bpm, 1.0);
+	double from = GetBpm(tick);
+	SampleTime sample = ToSamples(tick);
+	while (!segments_.empty() && segments_.back().start >= tick) {
+		segments_.pop_back();
+	}
+	// a ramp cut short by tick still plays as before up to tick
+
+	if (rampTicks > 0 && from != bpm) {
+		segments_.push_back(Segment(tick, sample, sampleRate_, from, bpm, rampTicks));
+		tick += rampTicks;
+		sample = RampToSamples(segments_.back(), tick);
+	}
+	segments_.push_back(Segment(tick, sample, sampleRate_, bpm, bpm, 0));
+}
+
+double TempoMap::GetBpm(Ticks tick) const
+{
+	const Segment& segment = segments_[FindTicks(tick)];
+	if (segment.rampTicks == 0) {
+		return segment.startBpm;
+	}
+	Ticks into = std::min(tick - segment.start, segment.rampTicks);
+	return segment.startBpm + (segment.endBpm - segment.startBpm) * into / segment.rampTicks;
+}
+
+SampleTime TempoMap::ToSamples(Ticks ticks) const
+{
+	const Segment& segment = segments_[FindTicks(ticks)];
+	if (segment.rampTicks > 0) {
+		return RampToSamples(segment, ticks);
+	}
+	return segment.startSample + segment.rate.ToSamples(ticks - segment.start);
+}
+
+Ticks TempoMap::ToTicks(SampleTime samples) const
+{
+	if (samples <= 0) {
+		return 0;
+	}
+	unsigned long index = FindSamples(samples);
+	const Segment& segment = segments_[index];
+	Ticks ticks;
+	if (segment.rampTicks == 0) {
+		ticks = segment.start + segment.rate.ToTicks(samples - segment.startSample);
+	}
+	else {
+		// invert the ramp, then step to the exact tick ToSamples agrees on
+		double b0 = segment.startBpm;
+		double slope = (segment.endBpm - b0) / segment.rampTicks;
+		double seconds = static_cast<double>(samples - segment.startSample) / sampleRate_;
+		double into = (b0 * exp(seconds * TicksPerBeat * slope / 60) - b0) / slope;
+		ticks = segment.start + std::max(static_cast<Ticks>(floor(into)), static_cast<Ticks>(0));
+		ticks = std::min(ticks, segment.start + segment.rampTicks);
+		while (RampToSamples(segment, ticks) < samples && ticks < segment.start + segment.rampTicks) {
+			ticks++;
+		}
+		while (ticks > segment.start && RampToSamples(segment, ticks - 1) >= samples) {
+			ticks--;
+		}
+	}
+	// the next segment starts on or after samples
+	if (index + 1 < segments_.size()) {
+		ticks = std::min(ticks, segments_[index + 1].start);
+	}
+	return ticks;
+}
+
+unsigned long TempoMap::FindTicks(Ticks ticks) const
+{
+	// the first segment starts at tick 0, so there always is one
+	unsigned long low = 1;
+	unsigned long high = segments_.size();
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (segments_[middle].start <= ticks) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low - 1;
+}
+
+unsigned long TempoMap::FindSamples(SampleTime samples) const
+{
+	unsigned long low = 1;
+	unsigned long high = segments_.size();
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (segments_[middle].startSample < samples) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low - 1;
+}
+
+SampleTime TempoMap::RampToSamples(const Segment& segment, Ticks ticks) const
+{
+	// the tempo moves linearly with ticks, so time is the log of the
+	// tempo ratio scaled by the ramp's length over its change in tempo
+	double b0 = segment.startBpm;
+	double slope = (segment.endBpm - b0) / segment.rampTicks;
+	double into = static_cast<double>(std::min(ticks - segment.start, segment.rampTicks));
+	double seconds = 60.0 / TicksPerBeat * log((b0 + slope * into) / b0) / slope;
+	// snap values within rounding error of a whole sample onto it
+	return segment.startSample + static_cast<SampleTime>(ceil(seconds * sampleRate_ - 1e-6));
+}
+
+void TempoMap::SetBeatsPerBar(Ticks tick, long beats)
+{
+	tick = NextBar(std::max(tick, static_cast<Ticks>(0)));
+	Ticks into;
+	long bar = GetBar(tick, into);
+	while (!meters_.empty() && meters_.back().start >= tick) {
+		meters_.pop_back();
+	}
+	meters_.push_back(Meter(tick, bar, std::max(beats, 1L)));
+}
+
+long TempoMap::GetBeatsPerBar(Ticks tick) const
+{
+	return meters_[FindMeter(tick)].beatsPerBar;
+}
+
+long TempoMap::GetBar(Ticks tick, Ticks& intoBar) const
+{
+	const Meter& meter = meters_[FindMeter(tick)];
+	Ticks length = TicksPerBeat * meter.beatsPerBar;
+	Ticks into = std::max(tick - meter.start, static_cast<Ticks>(0));
+	intoBar = into % length;
+	return meter.bar + static_cast<long>(into / length);
+}
+
+Ticks TempoMap::NextBar(Ticks tick) const
+{
+	// the next meter starts on a bar line of this one, so this never
+	// steps past it
+	const Meter& meter = meters_[FindMeter(tick)];
+	Ticks length = TicksPerBeat * meter.beatsPerBar;
+	Ticks into = std::max(tick - meter.start, static_cast<Ticks>(0));
+	return meter.start + (into + length - 1) / length * length;
+}
+
+unsigned long TempoMap::FindMeter(Ticks ticks) const
+{
+	// the first meter starts at tick 0, so there always is one
+	unsigned long low = 1;
+	unsigned long high = meters_.size();
+	while (low < high) {
+		unsigned long middle = (low + high) / 2;
+		if (meters_[middle].start <= ticks) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low - 1;
+}
+
+///////////////////////////
+// Transport
+///////////////////////////
+
+Transport::Transport(unsigned long sampleRate) : front_(0), back_(1), middle_(2), edited_(sampleRate), position_(0), blockFrames_(0)
+{
+	for (int i=0; i<3; i++) {
+		maps_[i] = edited_;
+	}
+}
+
+void Transport::BeginBlock()
+{
+	if (AtomicLoad(&middle_) & NewMap) {
+		// hand back the map in use and take the new one
+		front_ = AtomicExchange(&middle_, front_) & ~NewMap;
+	}
+}
+
+void Transport::SetTempo(double bpm, double rampBeats)
+{
+	Ticks tick = NextBoundary(edited_.ToTicks(GetSafePosition()), BEAT);
+	edited_.SetTempo(tick, bpm, BeatsToTicks(std::max(rampBeats, 0.0)));
+	Publish();
+}
+
+void Transport::SetBeatsPerBar(long beats)
+{
+	edited_.SetBeatsPerBar(edited_.ToTicks(GetSafePosition()), beats);
+	Publish();
+}
+
+SampleTime Transport::GetSafePosition() const
+{
+	// the audio thread can be up to a block past the position it reported,
+	// and into the next one by the time the map is picked up
+	return GetPosition() + 2 * AtomicLoad(const_cast<volatile long*>(&blockFrames_));
+}
+
+void Transport::Publish()
+{
+	// the back slot is never read by the audio thread, so it can be
+	// written at leisure before it is swapped into the middle
+	maps_[back_] = edited_;
+	back_ = AtomicExchange(&middle_, back_ | NewMap) & ~NewMap;
+}
+
+Ticks Transport::NextBoundary(Ticks ticks, Quantization quantize) const
+{
+	if (quantize == BEAT) {
+		return (ticks + TicksPerBeat - 1) / TicksPerBeat * TicksPerBeat;
+	}
+	if (quantize == BAR) {
+		return maps_[front_].NextBar(ticks);
+	}
+	return ticks;
+}
+
+SampleTime Transport::GetPosition() const
 {
-	return (BEAT_LENGTH * beats);
+	return AtomicLoad64(const_cast<volatile boost::int64_t*>(&position_));
+}
+
+void Transport::Advance(unsigned long frames)
+{
+	// only the audio thread moves the position, others just read it
+	AtomicStore(&blockFrames_, static_cast<long>(frames));
+	AtomicStore64(&position_, position_ + frames);
 }
 
 void ParsePitchString(const std::string& str, Scale& scale, short& root, short& octave, short& degree)
@@ -106,6 +454,45 @@ void ParsePitchString(const std::string& str, Scale& scale, short& root, short&
 	degreeStream >> degree;
 }
 
+short GetPitchFromString(const std::string& str)
+{
+	Scale scale;
+	short root;
+	short octave;
+	short degree;
+	ParsePitchString(str, scale, root, octave, degree);
+	return GetMidiPitch(scale, root, octave, degree);
+}
+
+bool ParsePitchSpec(const std::string& str, PitchSpec& spec)
+{
+	// only strings with all four fields and single digit octave and degree
+	// map on to the table. anything else is parsed when the note is generated.
+	size_t firstSplit = str.find('_', 0);
+	if (firstSplit == string::npos)
+		return false;
+	size_t secondSplit = str.find('_', firstSplit + 1);
+	if (secondSplit == string::npos)
+		return false;
+	size_t thirdSplit = str.find('_', secondSplit + 1);
+	if (thirdSplit == string::npos)
+		return false;
+	if (!isdigit((unsigned char)str[secondSplit + 1]) || thirdSplit + 1 >= str.size() || !isdigit((unsigned char)str[thirdSplit + 1]))
+		return false;
+
+	Scale scale;
+	short root;
+	short octave;
+	short degree;
+	ParsePitchString(str, scale, root, octave, degree);
+	// high octaves of high roots run past the last midi pitch
+	if (GetMidiPitch(scale, root, octave, degree) >= NumMidiPitches) {
+		return false;
+	}
+	spec.index = GetPitchTableIndex(scale, root, octave, degree);
+	return true;
+}
+
 void ParseScaleString(const std::string& str, Scale& scale, short& root)
 {
 	scale = NO_SCALE;
@@ -130,357 +517,1698 @@ void ParseScaleString(const std::string& str, Scale& scale, short& root)
 	}
 }
 
-ValueListSharedPtr NoteGenerator::Generate()
+bool ParseScale(const std::string& str, Scale& scale, short& root)
 {
-	ValueListSharedPtr pitchResult = pitchGen_->Generate();
-	ValueListSharedPtr velocityResult = velocityGen_->Generate();
-	ValueListSharedPtr lengthResult = lengthGen_->Generate();
+	ParseScaleString(str, scale, root);
+	return scale != NO_SCALE;
+}
 
-	short pitch;
-	if (std::string* pitchStr = boost::get<std::string>(pitchResult->at(0).get())) {
-		// parse pitch as string
-		Scale scale;
-		short root;
-		short octave;
-		short degree;
-		ParsePitchString(*pitchStr, scale, root, octave, degree);
-		pitch = GetMidiPitch(scale, root, octave, degree);
-	}
-	else if (int* pitchInt = boost::get<int>(pitchResult->at(0).get())) {
-		// parse pitch as int
-		pitch = *pitchInt;
-	}
+static int FloorDiv(int a, int b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
 
-	int* velocityPtr = boost::get<int>(velocityResult->at(0).get());
-	int velocity = 127;
-	if (velocityPtr != NULL) {
-		velocity = *velocityPtr;
+void BuildScaleMap(Scale scale, int root, int degrees, PitchMap& map)
+{
+	if (scale >= NumScales) {
+		for (int pitch=0; pitch<NumMidiPitches; pitch++) {
+			map.pitches[pitch] = pitch;
+		}
+		return;
 	}
+	const ScaleInfo& info = scaleInfo[scale];
 
-	float* lengthPtr = boost::get<float>(lengthResult->at(0).get());
-	float length = 1.0;
-	if (lengthPtr != NULL) {
-		length = *lengthPtr;
+	// degree of each pitch class in the scale, or -1 if it is not in it
+	int degreeOf[12];
+	for (int i=0; i<12; i++) {
+		degreeOf[i] = -1;
+	}
+	for (int i=0; i<info.numIntervals; i++) {
+		degreeOf[info.intervals[i]] = i;
 	}
 
-	// Create and return a note value
-	NoteSharedPtr note = NoteSharedPtr(new Note);
-	note->pitch = pitch;
-	note->velocity = velocity;
-	note->length = length;
+	for (int pitch=0; pitch<NumMidiPitches; pitch++) {
+		// find the nearest note of the scale, looking down first
+		int relative = pitch - root;
+		int distance;
+		for (distance=0; distance<12; distance++) {
+			int below = relative - distance;
+			if (degreeOf[below - 12 * FloorDiv(below, 12)] >= 0) {
+				relative = below;
+				break;
+			}
+			int above = relative + distance;
+			if (degreeOf[above - 12 * FloorDiv(above, 12)] >= 0) {
+				relative = above;
+				break;
+			}
+		}
 
-	boost::shared_ptr<ValueList> result(new ValueList);
-	result->push_back(ValueSharedPtr(new Value(note)));
-	return result;
+		// move along the scale in whole octaves plus the remaining degrees
+		int octave = FloorDiv(relative, 12);
+		int degree = degreeOf[relative - 12 * octave] + degrees;
+		octave += FloorDiv(degree, info.numIntervals);
+		degree -= info.numIntervals * FloorDiv(degree, info.numIntervals);
+		map.pitches[pitch] = static_cast<short>(root + 12 * octave + info.intervals[degree]);
+	}
 }
 
+MusicEvent MakeNoteEvent(short pitch, short velocity, float length)
+{
+	if (velocity < 0) {
+		velocity = 0;
+	}
+	else if (velocity > 127) {
+		velocity = 127;
+	}
+	MusicEvent event;
+	event.pitch = pitch;
+	event.velocity = static_cast<unsigned char>(velocity);
+	event.type = NOTE_EVENT;
+	event.length = length;
+	return event;
+}
 
-ValueListSharedPtr RestGenerator::Generate()
+MusicEvent MakeRestEvent(float length)
 {
-	ValueListSharedPtr lengthResult = lengthGen_->Generate();
+	MusicEvent event;
+	event.pitch = 0;
+	event.velocity = 0;
+	event.type = REST_EVENT;
+	event.length = length;
+	return event;
+}
 
-	float* lengthPtr = boost::get<float>(lengthResult->at(0).get());
-	float length = 1.0;
-	if (lengthPtr != NULL) {
-		length = *lengthPtr;
+// Returns the first value in a generated list if it holds a T
+template <typename T>
+static T* GetFirstValue(const ValueListSharedPtr& values)
+{
+	if (!values || values->empty() || !values->at(0)) {
+		return NULL;
 	}
+	return boost::get<T>(static_cast<Value*>(values->at(0).get()));
+}
 
-	// Create and return a rest value
-	RestSharedPtr rest = RestSharedPtr(new Rest);
-	rest->length = length;
+bool EventListStream::Next(MusicEvent& event)
+{
+	if (index_ >= events_.size) {
+		return false;
+	}
+	event = events_.data[index_];
+	index_++;
+	return true;
+}
 
-	boost::shared_ptr<ValueList> result(new ValueList);
-	result->push_back(ValueSharedPtr(new Value(rest)));
-	return result;
+bool EventListStream::Seek(double beat, double& wait)
+{
+	if (!beats_) {
+		return false;
+	}
+	index_ = beats_->Find(beat, wait);
+	return true;
 }
 
-ValueListSharedPtr PatternGenerator::Generate()
+double SkipBeats(EventStream& stream, double beats)
 {
-	boost::shared_ptr<ValueList> outResult(new ValueList);
-	for (unsigned long j=0; j<repeat_; j++)
-	{
-		for (unsigned long i=0; i<items_.size(); i++)
-		{
-			ValueListSharedPtr res = items_[i]->Generate();
-			outResult->insert(outResult->end(), res->begin(), res->end());
+	// the event that ends the walk is never pulled, so the stream is left
+	// right in front of it
+	double time = 0;
+	MusicEvent event;
+	while (time < beats && stream.Next(event)) {
+		if (event.type == REST_EVENT) {
+			time += event.length;
 		}
 	}
-	return outResult;
+	return time > beats ? time - beats : 0;
 }
 
-PatternGenSharedPtr PatternGenerator::MakeStatic()
-{
-	std::vector<GeneratorSharedPtr> gens;
+///////////////////////////
+// Beat index
+///////////////////////////
 
-	for (unsigned long j=0; j<repeat_; j++)
-	{
-		for (unsigned long i=0; i<items_.size(); i++)
-		{
-			ValueListSharedPtr valueList = items_[i]->Generate();
-			for (unsigned long k=0; k < valueList->size(); k++)
-			{
-				ValueSharedPtr valuePtr = valueList->at(k);
-				if (NoteSharedPtr* note = boost::get<NoteSharedPtr>(valuePtr.get())) 
-				{
-					GeneratorSharedPtr pitchGen( new SingleValueGenerator<int>((*note)->pitch) );
-					GeneratorSharedPtr velGen( new SingleValueGenerator<int>((*note)->velocity) );
-					GeneratorSharedPtr lenGen( new SingleValueGenerator<float>((*note)->length) );
-					NoteGenSharedPtr noteGen( new NoteGenerator(pitchGen, velGen, lenGen) );
-					gens.push_back(noteGen);
-				}
-				else if (RestSharedPtr* rest = boost::get<RestSharedPtr>(valuePtr.get())) {
-					GeneratorSharedPtr lenGen( new SingleValueGenerator<float>((*rest)->length) );
-					RestGenSharedPtr restGen( new RestGenerator(lenGen) );
-					gens.push_back(restGen);
-				}
-			}
+BeatIndex::BeatIndex(const EventView& events)
+{
+	starts_.reserve(events.size + 1);
+	double time = 0;
+	for (unsigned long i=0; i<events.size; i++) {
+		starts_.push_back(time);
+		if (events.data[i].type == REST_EVENT) {
+			time += events.data[i].length;
 		}
 	}
-
-	PatternGenSharedPtr newPatternGen(new PatternGenerator(gens , 1));
-	return newPatternGen;
+	starts_.push_back(time);
 }
 
-ValueListSharedPtr WeightedGenerator::Generate()
+unsigned long BeatIndex::Find(double beat, double& wait) const
 {
-	if (!randSeeded) {
-		srand ( static_cast<unsigned int>(time(NULL)) );
-		randSeeded = true;
+	unsigned long count = starts_.size() - 1;
+	std::vector<double>::const_iterator it = std::lower_bound(starts_.begin(), starts_.end(), beat);
+	if (it == starts_.end()) {
+		// past the end
+		wait = 0;
+		return count;
 	}
+	wait = *it - beat;
+	return std::min(static_cast<unsigned long>(it - starts_.begin()), count);
+}
 
-	unsigned long total = 0;
-	for (unsigned long i=0; i<values_.size(); i++) {
-		total += values_[i].second;
-	}
-	// TODO: make uniform distribution
-	int r = rand();
-	unsigned long num = r % total;
-	total = 0;
-	for (unsigned long i=0; i<values_.size(); i++) {
-		total += values_[i].second;
-		if (total > num) {
-			// found the item we are choosing
-			return values_[i].first->Generate();
-		}
-	}
+///////////////////////////
+// Profiling
+///////////////////////////
 
-	return ValueListSharedPtr();
-}
+static volatile long profilingEnabled = 0;
 
-ValueListSharedPtr TransposeGenerator::Generate()
+void SetProfiling(bool enabled)
 {
-	// figure out transpose amount based on scale and input number
-	ValueListSharedPtr pitchResult = scaleGen_->Generate();
-	std::string* pitchStr = boost::get<std::string>(pitchResult->at(0).get());
-	if (!pitchStr) {
-		cerr << "Failed to parse scale string for TransposeGen" << endl;
-		return ValueListSharedPtr();
-	}
-	Scale scale;
-	short root;
-	ParseScaleString(*pitchStr, scale, root);
-	const ScaleInfo* info = &scaleInfo[scale];
-	int octave = transposeAmount_ / info->numIntervals;
-	int correctedTransposeAmount = transposeAmount_;
-	if (transposeAmount_ < 0) {
-		correctedTransposeAmount = info->numIntervals - abs(transposeAmount_) % info->numIntervals;
-	}
-	int degree = info->intervals[correctedTransposeAmount % info->numIntervals];
-	int finalTranspose = 12 * octave;
-	if (transposeAmount_ >= 0) {
-		finalTranspose += degree;
-	}
-	else {
-		finalTranspose -= degree;
-	}
+	AtomicStore(&profilingEnabled, enabled ? 1 : 0);
+}
 
-	boost::shared_ptr<ValueList> events = gen_->Generate();
-	for (int i=0; i<events->size(); i++) {
-		boost::shared_ptr<Value> value = events->at(i);
-		if (Music::NoteSharedPtr* note = boost::get<NoteSharedPtr>(value.get())) {
-			(*note)->pitch += finalTranspose;
-		}
-	}
-	return events;
+bool IsProfiling()
+{
+	// a stale read only means a call is counted or missed around the switch
+	return profilingEnabled != 0;
 }
 
-Track::Track() : clearRequested_(false), addPartRequested_(false)
+static boost::int64_t GetProfileTicks()
 {
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<boost::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#endif
 }
 
-void Track::Add(GeneratorSharedPtr gen, Quantization quantize)
+double ProfileTicksToMilliseconds(boost::int64_t ticks)
 {
-	Part part = {false, 0, 0, quantize, gen, gen->Generate()};
-	addPartRequested_ = true;
-	addPart_ = part;
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return ticks * 1000.0 / frequency.QuadPart;
+#else
+	return ticks / 1000000.0;
+#endif
 }
 
-void Track::Remove(GeneratorSharedPtr gen)
+void Generator::RecordStats(boost::int64_t ticks, unsigned long items, boost::int64_t allocatedBytes)
 {
-	removeRequest_ = gen;
+	AtomicAdd64(&stats_.calls, 1);
+	AtomicAdd64(&stats_.items, items);
+	AtomicAdd64(&stats_.ticks, ticks);
+	AtomicAdd64(&stats_.allocatedBytes, allocatedBytes);
 }
 
-void Track::Clear()
+GeneratorStats Generator::GetStats()
 {
-	clearRequested_ = true;
+	GeneratorStats stats;
+	stats.calls = AtomicLoad64(&stats_.calls);
+	stats.items = AtomicLoad64(&stats_.items);
+	stats.ticks = AtomicLoad64(&stats_.ticks);
+	stats.allocatedBytes = AtomicLoad64(&stats_.allocatedBytes);
+	return stats;
 }
 
-void Track::Update(float songTime, float elapsedTime, vector<Event>& events, vector<float>& offsets)
+void Generator::ResetStats()
 {
-	// update active notes
-	map<short, ActiveNote>::iterator it;
-	for (it = activeNotes_.begin(); it != activeNotes_.end(); ) {
-		ActiveNote& activeNote = it->second;
-		if (elapsedTime >= activeNote.timeLeft) {
-			// if at the end of the buffer, wait until next update to generate note off
-			if (elapsedTime == activeNote.timeLeft) {
-				activeNote.timeLeft = 0;
-				it++;
-				continue;
-			}
-			// generate note off event
-			NoteOffEvent off;
-			off.pitch = activeNote.pitch;
-			events.push_back(off);
-			offsets.push_back(activeNote.timeLeft);
+	AtomicStore64(&stats_.calls, 0);
+	AtomicStore64(&stats_.items, 0);
+	AtomicStore64(&stats_.ticks, 0);
+	AtomicStore64(&stats_.allocatedBytes, 0);
+}
 
-			// remove active note
-			map<short, ActiveNote>::iterator removeIt = it;
-			it++;
-			activeNotes_.erase(removeIt);
-		}
-		else {
-			it++;
-		}
+static void DumpStatsNode(Generator* gen, int depth, std::set<Generator*>& seen, std::ostream& out)
+{
+	out << std::string(depth * 2, ' ') << gen->Name();
+	if (!seen.insert(gen).second) {
+		// shared subgraphs are only listed in full the first time
+		out << " (shared, see above)" << endl;
+		return;
 	}
+	std::vector<Generator*> children;
+	gen->GetChildren(children);
 
-	if (clearRequested_) {
-		parts_.clear();
-		clearRequested_ = false;
+	GeneratorStats stats = gen->GetStats();
+	boost::int64_t childTicks = 0;
+	for (unsigned long i=0; i<children.size(); i++) {
+		if (children[i]) {
+			childTicks += children[i]->GetStats().ticks;
+		}
 	}
+	out << ": calls " << stats.calls << ", items " << stats.items;
+	out << std::fixed << std::setprecision(3);
+	out << ", time " << ProfileTicksToMilliseconds(stats.ticks) << "ms";
+	out << " (self " << ProfileTicksToMilliseconds(std::max<boost::int64_t>(stats.ticks - childTicks, 0)) << "ms)";
+	out << ", allocated " << stats.allocatedBytes << " bytes" << endl;
 
-	// check for remove request
-	if (removeRequest_) {
-		for (list<Part>::iterator i = parts_.begin(); i != parts_.end(); ) {
-			Part& part = *i;
-			if (part.gen == removeRequest_) {
-				parts_.erase(i);
-				break;
-			}
+	for (unsigned long i=0; i<children.size(); i++) {
+		if (children[i]) {
+			DumpStatsNode(children[i], depth + 1, seen, out);
 		}
-		removeRequest_.reset();
 	}
+}
 
-	// check for add request
-	if (addPartRequested_) {
-		parts_.push_back(addPart_);
-		addPartRequested_ = false;
+void DumpStats(Generator* root, std::ostream& out)
+{
+	std::set<Generator*> seen;
+	if (root) {
+		DumpStatsNode(root, 0, seen, out);
 	}
+}
 
-	for (list<Part>::iterator i = parts_.begin(); i != parts_.end(); )
-	{
-		Part& part = *i;
+void ResetStats(Generator* root)
+{
+	if (!root) {
+		return;
+	}
+	root->ResetStats();
+	std::vector<Generator*> children;
+	root->GetChildren(children);
+	for (unsigned long i=0; i<children.size(); i++) {
+		ResetStats(children[i]);
+	}
+}
 
-		float timeUsed = 0;
-		while (timeUsed < elapsedTime)
-		{
-			float timeUsedThisIteration = 0;
+///////////////////////////
+// Generator base class
+///////////////////////////
 
-			// if there is left over time from a previously encountered rest, then consume it.
-			if (part.waitTime > 0) 
-			{
-				if (timeUsed + part.waitTime > elapsedTime) {
-					// wait time is bigger than time left in window. use up as much wait time as we can.
-					float timeLeftInFrame = elapsedTime - timeUsed;
-					part.waitTime -= timeLeftInFrame;
-					timeUsed = elapsedTime;
-					timeUsedThisIteration = timeLeftInFrame;
+ValueListSharedPtr Generator::Generate(GenerationContext& context)
+{
+	if (!IsProfiling()) {
+		return DoGenerate(context);
+	}
+	boost::int64_t start = GetProfileTicks();
+	boost::int64_t allocated = GetThreadAllocatedBytes();
+	ValueListSharedPtr result = DoGenerate(context);
+	unsigned long count = result ? result->size() : 0;
+	RecordStats(GetProfileTicks() - start, count, GetThreadAllocatedBytes() - allocated);
+	return result;
+}
+
+ValueListSharedPtr Generator::DoGenerate(GenerationContext& context)
+{
+	return MakeValueList();
+}
+
+EventListSharedPtr Generator::GenerateEvents(GenerationContext& context)
+{
+	EventListSharedPtr result(new EventList);
+	EventSink sink(*result);
+	GenerateInto(context, sink);
+	return result;
+}
+
+void Generator::GenerateInto(GenerationContext& context, EventSink& sink)
+{
+	if (!IsProfiling()) {
+		GenerateIntoShared(context, sink);
+		return;
+	}
+	boost::int64_t start = GetProfileTicks();
+	boost::int64_t allocated = GetThreadAllocatedBytes();
+	unsigned long before = sink.Size();
+	GenerateIntoShared(context, sink);
+	unsigned long count = sink.Size() - before;
+	RecordStats(GetProfileTicks() - start, count, GetThreadAllocatedBytes() - allocated);
+}
+
+void Generator::GenerateIntoShared(GenerationContext& context, EventSink& sink)
+{
+	GenerationCache* cache = context.cache;
+	if (!cache || !cache->IsShared(this)) {
+		GenerateIntoReused(context, sink);
+		return;
+	}
+	ConstEventListSharedPtr cached = cache->Find(this);
+	if (!cached) {
+		unsigned long start = sink.Size();
+		GenerateIntoReused(context, sink);
+		ConstEventListSharedPtr result(new EventList(sink.Events().begin() + start, sink.Events().end()));
+		cached = cache->Store(this, result);
+		if (cached == result) {
+			return;
+		}
+		// another thread got there first, use its output so every use matches
+		sink.Truncate(start);
+	}
+	sink.Add(*cached);
+}
+
+void Generator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+}
+
+EventStreamSharedPtr Generator::Stream(const GenerationContext& context)
+{
+	GenerationContext streamContext = context;
+	EventView events(GenerateEvents(streamContext));
+	// indexing costs less than generating did, so the stream can seek
+	return EventStreamSharedPtr(new EventListStream(events, BeatIndexSharedPtr(new BeatIndex(events))));
+}
+
+///////////////////////////
+// Dirty tracking
+///////////////////////////
+
+namespace
+{
+
+// kept outputs are stored direct mapped by random stream, so a generator
+// used in many places keeps a bounded number of them
+const unsigned long KeptSlots = 16;
+
+// below this many events, copying the output of a node that is not the
+// root of a subtree costs about as much as generating it again
+const unsigned long KeptMinEvents = 64;
+
+unsigned long KeptSlot(const RandomStream& random)
+{
+	boost::uint64_t h = random.Key() ^ (random.Counter() * 0x9E3779B97F4A7C15ULL);
+	return static_cast<unsigned long>((h ^ (h >> 32)) % KeptSlots);
+}
+
+}
+
+namespace
+{
+
+// leaked on purpose, generators held by other statics unlink themselves
+// during static destruction
+boost::recursive_mutex* graphMutex = NULL;
+boost::once_flag graphMutexOnce = BOOST_ONCE_INIT;
+
+void CreateGraphMutex()
+{
+	graphMutex = new boost::recursive_mutex;
+}
+
+}
+
+boost::recursive_mutex& GetGraphMutex()
+{
+	boost::call_once(graphMutexOnce, &CreateGraphMutex);
+	return *graphMutex;
+}
+
+void Generator::Link()
+{
+	boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+	std::vector<Generator*> children;
+	GetChildren(children);
+	for (unsigned long i=0; i<children.size(); i++) {
+		if (children[i]) {
+			children[i]->parents_.push_back(this);
+		}
+	}
+}
+
+void Generator::Unlink()
+{
+	boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+	std::vector<Generator*> children;
+	GetChildren(children);
+	for (unsigned long i=0; i<children.size(); i++) {
+		if (!children[i]) {
+			continue;
+		}
+		// remove one entry per reference, the same child may be listed twice
+		std::vector<Generator*>& parents = children[i]->parents_;
+		std::vector<Generator*>::iterator it = std::find(parents.begin(), parents.end(), this);
+		if (it != parents.end()) {
+			parents.erase(it);
+		}
+	}
+}
+
+void Generator::ReplaceChild(GeneratorSharedPtr& child, GeneratorSharedPtr newChild)
+{
+	boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+	if (child) {
+		std::vector<Generator*>& parents = child->parents_;
+		std::vector<Generator*>::iterator it = std::find(parents.begin(), parents.end(), this);
+		if (it != parents.end()) {
+			parents.erase(it);
+		}
+	}
+	child = newChild;
+	if (child) {
+		child->parents_.push_back(this);
+	}
+	Invalidate();
+}
+
+void Generator::Invalidate()
+{
+	boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+	std::set<Generator*> visited;
+	std::vector<Generator*> pending(1, this);
+	std::vector<ConstEventListSharedPtr> dropped;
+	while (!pending.empty())
+	{
+		Generator* gen = pending.back();
+		pending.pop_back();
+		if (!visited.insert(gen).second) {
+			continue;
+		}
+		AtomicIncrement(&gen->version_);
+		{
+			boost::lock_guard<boost::mutex> keptLock(gen->keptMutex_);
+			for (unsigned long i=0; i<gen->kept_.size(); i++) {
+				dropped.push_back(gen->kept_[i].events);
+			}
+			gen->kept_.clear();
+		}
+		pending.insert(pending.end(), gen->parents_.begin(), gen->parents_.end());
+	}
+	// dropped outputs are freed here, outside of the lock
+}
+
+long Generator::GetVersion() const
+{
+	return AtomicLoad(const_cast<volatile long*>(&version_));
+}
+
+void Generator::GenerateIntoReused(GenerationContext& context, EventSink& sink)
+{
+	// with shared randomness the output of a node also depends on where its
+	// shared children were first generated, which the stream does not capture
+	GenerationCache* cache = context.cache;
+	if (!context.reuseOutputs || !cache || cache->SharesRandomness()) {
+		DoGenerateInto(context, sink);
+		return;
+	}
+
+	// output without random choices only changes with the version, so it is
+	// found again whatever stream it is asked for with
+	bool deterministic = cache->IsDeterministic(this);
+	boost::uint64_t key = deterministic ? 0 : context.random.Key();
+	boost::uint64_t counter = deterministic ? 0 : context.random.Counter();
+	unsigned long slot = deterministic ? 0 : KeptSlot(context.random);
+	{
+		boost::lock_guard<boost::mutex> lock(keptMutex_);
+		if (slot < kept_.size() && kept_[slot].events && kept_[slot].key == key && kept_[slot].counter == counter) {
+			context.random.Seek(context.random.Counter() + kept_[slot].advance);
+			sink.Add(*kept_[slot].events);
+			return;
+		}
+	}
+
+	long version = GetVersion();
+	boost::uint64_t startCounter = context.random.Counter();
+	unsigned long start = sink.Size();
+	DoGenerateInto(context, sink);
+
+	// small outputs inside a subtree are cheaper to generate again than to
+	// copy at every level
+	if (!cache->IsSubtreeRoot(this) && sink.Size() - start < KeptMinEvents) {
+		return;
+	}
+	ConstEventListSharedPtr events(new EventList(sink.Events().begin() + start, sink.Events().end()));
+	KeptOutput kept = { key, counter, context.random.Counter() - startCounter, events };
+	boost::lock_guard<boost::mutex> lock(keptMutex_);
+	// an edit that came in while generating makes this output stale
+	if (version == GetVersion()) {
+		if (slot >= kept_.size()) {
+			kept_.resize(deterministic ? 1 : KeptSlots);
+		}
+		kept_[slot] = kept;
+	}
+}
+
+///////////////////////////
+// Generation cache
+///////////////////////////
+
+namespace
+{
+
+struct GraphNodeInfo
+{
+	GraphNodeInfo() : visited(false), deterministic(true), multiUse(false), parents(0) {}
+	bool visited;
+	bool deterministic;
+	bool multiUse;
+	unsigned long parents;
+	std::vector<Generator*> children;
+};
+typedef std::map<const Generator*, GraphNodeInfo> GraphInfo;
+
+// depth first walk that appends nodes in post order
+void VisitGraph(Generator* gen, GraphInfo& info, std::vector<Generator*>& postOrder)
+{
+	GraphNodeInfo& node = info[gen];
+	if (node.visited) {
+		return;
+	}
+	node.visited = true;
+	gen->GetChildren(node.children);
+	bool deterministic = !gen->IsRandom();
+	for (unsigned long i=0; i<node.children.size(); i++) {
+		Generator* child = node.children[i];
+		if (!child) {
+			continue;
+		}
+		VisitGraph(child, info, postOrder);
+		GraphNodeInfo& childNode = info[child];
+		childNode.parents++;
+		deterministic = deterministic && childNode.deterministic;
+	}
+	node.deterministic = deterministic;
+	postOrder.push_back(gen);
+}
+
+}
+
+GenerationCache::GenerationCache(Generator* root, bool sharedRandomness) : sharedRandomness_(sharedRandomness)
+{
+	if (!root) {
+		return;
+	}
+	GraphInfo info;
+	std::vector<Generator*> postOrder;
+	VisitGraph(root, info, postOrder);
+
+	subtreeRoots_.insert(root);
+	// parents come before their children in reverse post order, so whether a
+	// node is used more than once can be pushed down in a single sweep
+	for (long i=postOrder.size()-1; i>=0; i--) {
+		Generator* gen = postOrder[i];
+		GraphNodeInfo& node = info[gen];
+		if (node.parents > 1) {
+			node.multiUse = true;
+		}
+		bool childrenMultiUse = node.multiUse || gen->GetRepeat() > 1;
+		for (unsigned long j=0; j<node.children.size(); j++) {
+			if (!node.children[j]) {
+				continue;
+			}
+			GraphNodeInfo& child = info[node.children[j]];
+			if (childrenMultiUse) {
+				child.multiUse = true;
+			}
+			if (!node.deterministic && child.deterministic) {
+				subtreeRoots_.insert(node.children[j]);
+			}
+		}
+		if (node.deterministic) {
+			deterministic_.insert(gen);
+		}
+		if (node.multiUse && (node.deterministic || sharedRandomness)) {
+			shared_.insert(gen);
+		}
+	}
+}
+
+ConstEventListSharedPtr GenerationCache::Find(const Generator* gen)
+{
+	boost::lock_guard<boost::mutex> lock(mutex_);
+	std::map<const Generator*, ConstEventListSharedPtr>::const_iterator it = results_.find(gen);
+	if (it == results_.end()) {
+		return ConstEventListSharedPtr();
+	}
+	return it->second;
+}
+
+ConstEventListSharedPtr GenerationCache::Store(const Generator* gen, ConstEventListSharedPtr events)
+{
+	boost::lock_guard<boost::mutex> lock(mutex_);
+	std::pair<std::map<const Generator*, ConstEventListSharedPtr>::iterator, bool> inserted = results_.insert(std::make_pair(gen, events));
+	return inserted.first->second;
+}
+
+EventListSharedPtr GenerateShared(GeneratorSharedPtr gen, const RandomStream& random, bool sharedRandomness, TaskPool* pool)
+{
+	if (!gen) {
+		return EventListSharedPtr();
+	}
+	GenerationContext context(random);
+	context.pool = pool;
+	GenerationCache cache(gen.get(), sharedRandomness);
+	context.cache = &cache;
+	return gen->GenerateEvents(context);
+}
+
+void NoteGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	ValueListSharedPtr pitchResult = pitchGen_->Generate(context);
+	ValueListSharedPtr velocityResult = velocityGen_->Generate(context);
+	ValueListSharedPtr lengthResult = lengthGen_->Generate(context);
+
+	short pitch = 0;
+	if (PitchSpec* pitchSpec = GetFirstValue<PitchSpec>(pitchResult)) {
+		// pitch was resolved when the generator was built
+		pitch = GetPitch(*pitchSpec);
+	}
+	else if (std::string* pitchStr = GetFirstValue<std::string>(pitchResult)) {
+		// parse pitch as string
+		pitch = GetPitchFromString(*pitchStr);
+	}
+	else if (int* pitchInt = GetFirstValue<int>(pitchResult)) {
+		// parse pitch as int
+		pitch = *pitchInt;
+	}
+
+	int* velocityPtr = GetFirstValue<int>(velocityResult);
+	int velocity = 127;
+	if (velocityPtr != NULL) {
+		velocity = *velocityPtr;
+	}
+
+	float* lengthPtr = GetFirstValue<float>(lengthResult);
+	float length = 1.0;
+	if (lengthPtr != NULL) {
+		length = *lengthPtr;
+	}
+
+	sink.Add(MakeNoteEvent(pitch, velocity, length));
+}
+
+void NoteGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	children.push_back(pitchGen_.get());
+	children.push_back(velocityGen_.get());
+	children.push_back(lengthGen_.get());
+}
+
+
+void RestGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	ValueListSharedPtr lengthResult = lengthGen_->Generate(context);
+
+	float* lengthPtr = GetFirstValue<float>(lengthResult);
+	float length = 1.0;
+	if (lengthPtr != NULL) {
+		length = *lengthPtr;
+	}
+
+	sink.Add(MakeRestEvent(length));
+}
+
+void RestGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	children.push_back(lengthGen_.get());
+}
+
+void PatternGenerator::GenerateRange(GenerationContext context, unsigned long begin, unsigned long end, EventSink& sink)
+{
+	for (unsigned long k=begin; k<end; k++)
+	{
+		// every item of every repeat gets its own random stream
+		GenerationContext itemContext = context;
+		itemContext.random = context.random.Split(k);
+		items_[k % items_.size()]->GenerateInto(itemContext, sink);
+	}
+}
+
+void PatternGenerator::GenerateChunk(GenerationContext context, unsigned long begin, unsigned long end, EventList* out)
+{
+	EventSink sink(*out);
+	GenerateRange(context, begin, end, sink);
+}
+
+void PatternGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	unsigned long total = repeat_ * items_.size();
+
+	// with shared randomness the first thread to finish a subgraph would
+	// decide its output, so those passes stay on one thread
+	bool parallel = context.pool && total > 1 && !(context.cache && context.cache->SharesRandomness());
+	if (!parallel) {
+		GenerateRange(context, 0, total, sink);
+		return;
+	}
+
+	// split the items into a few contiguous chunks per worker. each item
+	// still gets the same random stream it would get on one thread, so the
+	// result does not depend on how the work was divided.
+	TaskPool& pool = *context.pool;
+	unsigned long chunks = std::min(total, pool.Size() * 4);
+	GenerationContext chunkContext = context;
+	if (total >= pool.Size()) {
+		// enough work at this level to keep every worker busy
+		chunkContext.pool = NULL;
+	}
+	std::vector<EventList> parts(chunks);
+	{
+		TaskGroup group(pool);
+		for (unsigned long c=0; c<chunks; c++) {
+			group.Run(boost::bind(&PatternGenerator::GenerateChunk, this, chunkContext, total * c / chunks, total * (c + 1) / chunks, &parts[c]));
+		}
+		group.Wait();
+	}
+	for (unsigned long c=0; c<chunks; c++) {
+		sink.Add(parts[c]);
+	}
+}
+
+void PatternGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	for (unsigned long i=0; i<items_.size(); i++) {
+		children.push_back(items_[i].get());
+	}
+}
+
+// Walks the items of a pattern, pulling from the stream of one item at a time
+class PatternStream : public EventStream
+{
+public:
+	PatternStream(const std::vector<GeneratorSharedPtr>& items, unsigned long repeat, const GenerationContext& context) :
+		items_(items), repeat_(repeat), context_(context), currentRepeat_(0), currentItem_(0)
+	{
+		// the stream can outlive the pass that made it, along with its cache
+		context_.cache = NULL;
+	}
+
+	virtual bool Next(MusicEvent& event)
+	{
+		if (items_.empty()) {
+			return false;
+		}
+		while (currentRepeat_ < repeat_)
+		{
+			if (!current_) {
+				// split the random stream the same way GenerateEvents does
+				GenerationContext itemContext = context_;
+				itemContext.random = context_.random.Split(currentRepeat_ * items_.size() + currentItem_);
+				current_ = items_[currentItem_]->Stream(itemContext);
+			}
+			if (current_ && current_->Next(event)) {
+				return true;
+			}
+			// current item is exhausted, move on to the next one
+			current_.reset();
+			currentItem_++;
+			if (currentItem_ >= items_.size()) {
+				currentItem_ = 0;
+				currentRepeat_++;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<GeneratorSharedPtr> items_;
+	unsigned long repeat_;
+	GenerationContext context_;
+	unsigned long currentRepeat_;
+	unsigned long currentItem_;
+	EventStreamSharedPtr current_;
+};
+
+EventStreamSharedPtr PatternGenerator::Stream(const GenerationContext& context)
+{
+	return EventStreamSharedPtr(new PatternStream(items_, repeat_, context));
+}
+
+void PatternGenerator::SetRepeat(unsigned long repeat)
+{
+	boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+	repeat_ = repeat;
+	Invalidate();
+}
+
+GeneratorSharedPtr Generator::MakeStatic(const RandomStream& random, bool sharedRandomness, TaskPool* pool, bool reuseOutputs)
+{
+	GenerationContext context(random);
+	context.pool = pool;
+	context.reuseOutputs = reuseOutputs;
+	GenerationCache cache(this, sharedRandomness);
+	context.cache = &cache;
+	// the static sequence takes over the generated list without copying it
+	EventListSharedPtr events = GenerateEvents(context);
+	return GeneratorSharedPtr(new StaticSequenceGenerator(EventView(events)));
+}
+
+void StaticSequenceGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	sink.Add(events_.data, events_.size);
+}
+
+EventStreamSharedPtr StaticSequenceGenerator::Stream(const GenerationContext& context)
+{
+	// the events never change, so the stream can read them in place
+	return EventStreamSharedPtr(new EventListStream(events_, GetBeatIndex()));
+}
+
+BeatIndexSharedPtr StaticSequenceGenerator::GetBeatIndex() const
+{
+	boost::lock_guard<boost::mutex> lock(beatsMutex_);
+	if (!beats_) {
+		beats_.reset(new BeatIndex(events_));
+	}
+	return beats_;
+}
+
+boost::uint64_t GetClockSeed()
+{
+	static unsigned long seedsTaken = 0;
+	RandomStream clock(static_cast<boost::uint64_t>(time(NULL)));
+	return clock.Split(seedsTaken++).Key();
+}
+
+void AliasTable::Build(const std::vector<float>& weights)
+{
+	probability_.clear();
+	alias_.clear();
+
+	double total = 0;
+	for (unsigned long i=0; i<weights.size(); i++) {
+		if (weights[i] > 0) {
+			total += weights[i];
+		}
+	}
+	if (total <= 0) {
+		return;
+	}
+
+	unsigned long n = weights.size();
+	probability_.resize(n, 1.0f);
+	alias_.resize(n, 0);
+
+	// scale the weights so that the average is 1, then pair every column
+	// below average with one above it
+	std::vector<double> scaled(n);
+	std::vector<unsigned long> small;
+	std::vector<unsigned long> large;
+	for (unsigned long i=0; i<n; i++) {
+		scaled[i] = weights[i] > 0 ? weights[i] * n / total : 0;
+		if (scaled[i] < 1) {
+			small.push_back(i);
+		}
+		else {
+			large.push_back(i);
+		}
+	}
+	while (!small.empty() && !large.empty()) {
+		unsigned long less = small.back();
+		small.pop_back();
+		unsigned long more = large.back();
+		large.pop_back();
+
+		probability_[less] = static_cast<float>(scaled[less]);
+		alias_[less] = more;
+		scaled[more] = (scaled[more] + scaled[less]) - 1;
+		if (scaled[more] < 1) {
+			small.push_back(more);
+		}
+		else {
+			large.push_back(more);
+		}
+	}
+	// whatever is left over is full, up to rounding error
+	for (unsigned long i=0; i<large.size(); i++) {
+		probability_[large[i]] = 1.0f;
+	}
+	for (unsigned long i=0; i<small.size(); i++) {
+		probability_[small[i]] = 1.0f;
+	}
+}
+
+unsigned long AliasTable::Sample(double random) const
+{
+	unsigned long n = probability_.size();
+	double x = random * n;
+	unsigned long column = static_cast<unsigned long>(x);
+	if (column >= n) {
+		column = n - 1;
+	}
+	if (x - column < probability_[column]) {
+		return column;
+	}
+	return alias_[column];
+}
+
+WeightedGenerator::WeightedGenerator(const std::vector<WeightedValue>& values) : values_(values)
+{
+	std::vector<float> weights;
+	for (unsigned long i=0; i<values_.size(); i++) {
+		weights.push_back(values_[i].second);
+	}
+	table_.Build(weights);
+	Link();
+}
+
+Generator* WeightedGenerator::Choose(GenerationContext& context)
+{
+	if (table_.Empty()) {
+		return NULL;
+	}
+	return values_[table_.Sample(context.random.NextUnit())].first.get();
+}
+
+ValueListSharedPtr WeightedGenerator::DoGenerate(GenerationContext& context)
+{
+	Generator* gen = Choose(context);
+	if (!gen) {
+		return ValueListSharedPtr();
+	}
+	return gen->Generate(context);
+}
+
+void WeightedGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	Generator* gen = Choose(context);
+	if (gen) {
+		gen->GenerateInto(context, sink);
+	}
+}
+
+void WeightedGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	for (unsigned long i=0; i<values_.size(); i++) {
+		children.push_back(values_[i].first.get());
+	}
+}
+
+bool WeightedGenerator::IsRandom() const
+{
+	// a single possible choice always gives the same result
+	unsigned long choices = 0;
+	for (unsigned long i=0; i<values_.size(); i++) {
+		if (values_[i].second > 0) {
+			choices++;
+		}
+	}
+	return choices > 1;
+}
+
+EventStreamSharedPtr WeightedGenerator::Stream(const GenerationContext& context)
+{
+	// the choice is made once per stream, just like a call to Generate
+	GenerationContext streamContext = context;
+	Generator* gen = Choose(streamContext);
+	if (!gen) {
+		return EventStreamSharedPtr();
+	}
+	return gen->Stream(streamContext);
+}
+
+// Scale strings are fixed when a graph is built, so they are read once with
+// a default context
+static bool GetScaleFromGenerator(GeneratorSharedPtr scaleGen, const char* name, Scale& scale, short& root)
+{
+	GenerationContext scaleContext;
+	ValueListSharedPtr scaleResult = scaleGen ? scaleGen->Generate(scaleContext) : ValueListSharedPtr();
+	std::string* scaleStr = GetFirstValue<std::string>(scaleResult);
+	if (!scaleStr || !ParseScale(*scaleStr, scale, root)) {
+		cerr << "Failed to parse scale string for " << name << endl;
+		return false;
+	}
+	return true;
+}
+
+TransposeGenerator::TransposeGenerator(GeneratorSharedPtr gen, GeneratorSharedPtr scaleGen, int transposeAmount) :
+	gen_(gen), scaleGen_(scaleGen), transposeAmount_(transposeAmount), valid_(false), semitones_(0)
+{
+	Link();
+
+	// figure out transpose amount based on scale and input number
+	Scale scale;
+	short root;
+	if (!GetScaleFromGenerator(scaleGen_, "TransposeGen", scale, root)) {
+		return;
+	}
+	const ScaleInfo* info = &scaleInfo[scale];
+	int octave = transposeAmount_ / info->numIntervals;
+	int correctedTransposeAmount = transposeAmount_;
+	if (transposeAmount_ < 0) {
+		correctedTransposeAmount = info->numIntervals - abs(transposeAmount_) % info->numIntervals;
+	}
+	int degree = info->intervals[correctedTransposeAmount % info->numIntervals];
+	semitones_ = 12 * octave;
+	if (transposeAmount_ >= 0) {
+		semitones_ += degree;
+	}
+	else {
+		semitones_ -= degree;
+	}
+	valid_ = true;
+}
+
+bool TransposeGenerator::GetTransposeInSemitones(int& semitones) const
+{
+	semitones = semitones_;
+	return valid_;
+}
+
+void TransposeGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	int finalTranspose;
+	if (!GetTransposeInSemitones(finalTranspose)) {
+		return;
+	}
+
+	// transpose what the child added, in place
+	unsigned long start = sink.Size();
+	gen_->GenerateInto(context, sink);
+	if (sink.Size() > start) {
+		TransposeEvents(sink.At(start), sink.Size() - start, finalTranspose);
+	}
+}
+
+void TransposeGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	children.push_back(gen_.get());
+	children.push_back(scaleGen_.get());
+}
+
+// Transposes the notes of another stream as they are pulled
+class TransposeStream : public EventStream
+{
+public:
+	TransposeStream(EventStreamSharedPtr source, int semitones) : source_(source), semitones_(semitones) {}
+
+	virtual bool Next(MusicEvent& event)
+	{
+		if (!source_ || !source_->Next(event)) {
+			return false;
+		}
+		if (event.type == NOTE_EVENT) {
+			event.pitch += semitones_;
+		}
+		return true;
+	}
+
+private:
+	EventStreamSharedPtr source_;
+	int semitones_;
+};
+
+EventStreamSharedPtr TransposeGenerator::Stream(const GenerationContext& context)
+{
+	int finalTranspose;
+	if (!GetTransposeInSemitones(finalTranspose)) {
+		return EventStreamSharedPtr();
+	}
+	return EventStreamSharedPtr(new TransposeStream(gen_->Stream(context), finalTranspose));
+}
+
+QuantizeGenerator::QuantizeGenerator(GeneratorSharedPtr gen, GeneratorSharedPtr scaleGen, int degrees) :
+	gen_(gen), scaleGen_(scaleGen), degrees_(degrees), valid_(false)
+{
+	Link();
+
+	Scale scale;
+	short root;
+	if (GetScaleFromGenerator(scaleGen_, "QuantizeGen", scale, root)) {
+		BuildScaleMap(scale, root, degrees, map_);
+		valid_ = true;
+	}
+}
+
+void QuantizeGenerator::DoGenerateInto(GenerationContext& context, EventSink& sink)
+{
+	if (!valid_) {
+		return;
+	}
+	unsigned long start = sink.Size();
+	gen_->GenerateInto(context, sink);
+	if (sink.Size() > start) {
+		MapEventPitches(sink.At(start), sink.Size() - start, map_);
+	}
+}
+
+void QuantizeGenerator::GetChildren(std::vector<Generator*>& children) const
+{
+	children.push_back(gen_.get());
+	children.push_back(scaleGen_.get());
+}
+
+// Maps the pitches of another stream as they are pulled
+class PitchMapStream : public EventStream
+{
+public:
+	PitchMapStream(EventStreamSharedPtr source, const PitchMap& map) : source_(source), map_(map) {}
+
+	virtual bool Next(MusicEvent& event)
+	{
+		if (!source_ || !source_->Next(event)) {
+			return false;
+		}
+		MapEventPitches(&event, 1, map_);
+		return true;
+	}
+
+private:
+	EventStreamSharedPtr source_;
+	PitchMap map_;
+};
+
+EventStreamSharedPtr QuantizeGenerator::Stream(const GenerationContext& context)
+{
+	if (!valid_) {
+		return EventStreamSharedPtr();
+	}
+	return EventStreamSharedPtr(new PitchMapStream(gen_->Stream(context), map_));
+}
+
+Track::Track(const Transport& transport) : transport_(transport), tempoScale_(1), random_(GetClockSeed()), partsAdded_(0), livingParts_(0), stopLookahead_(false)
+{
+	parts_.reserve(MaxParts);
+	for (int i=0; i<ActiveMaskWords; i++) {
+		activeMask_[i] = 0;
+	}
+	for (int i=0; i<NumMidiPitches; i++) {
+		activeEnd_[i] = 0;
+	}
+	lookaheadThread_ = boost::thread(&Track::LookaheadLoop, this);
+}
+
+Track::~Track()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(loopsMutex_);
+		stopLookahead_ = true;
+	}
+	lookaheadWake_.notify_all();
+	lookaheadThread_.join();
+}
+
+void Track::Seed(boost::uint64_t seed)
+{
+	random_ = RandomStream(seed);
+	partsAdded_ = 0;
+}
+
+namespace
+{
+
+// longest cycle generated ahead of time, about 16MB with its beat index
+const boost::uint64_t MaxMaterializedEvents = 1 << 20;
+
+#ifdef _DEBUG
+// debug builds check programs against their graph when they are this small
+const boost::uint64_t MaxCheckedEvents = 4096;
+const unsigned long CheckedSeeds = 8;
+#endif
+
+}
+
+void Track::BuildPlaying(PartLoop& loop)
+{
+	loop.version = loop.gen->GetVersion();
+	loop.playing = OptimizeGraph(loop.gen);
+	loop.program = CompileProgram(loop.playing);
+	// a typo in a repeat count must not run the host out of memory
+	EventCounter counter;
+	boost::uint64_t count = counter.Count(loop.playing.get());
+	loop.materialize = count <= MaxMaterializedEvents;
+	// a graph that does not compile can not be checked, so it is assumed
+	// to take time
+	AtomicStore(&loop.takesTime, (!loop.program || loop.program->takesTime_) ? 1 : 0);
+#ifdef _DEBUG
+	// the program must choose exactly what the graph would, down to
+	// choices that can never be picked
+	if (loop.program && count <= MaxCheckedEvents) {
+		for (unsigned long i=0; i<CheckedSeeds; i++) {
+			assert(MatchesGraph(loop.program, loop.playing, loop.random.Split(i)));
+		}
+	}
+#endif
+}
+
+namespace
+{
+
+// count is set to the number of events generated up front
+EventStreamSharedPtr GenerateCycle(GeneratorSharedPtr playing, ProgramSharedPtr program, bool materialize, const RandomStream& random, unsigned long& count)
+{
+	count = 0;
+	EventListSharedPtr events;
+	if (program) {
+		// graphs that compile run on the program interpreter
+		EventStreamSharedPtr stream(new ProgramStream(program, random));
+		if (!materialize) {
+			// too long to hold in memory, the audio thread runs the program
+			// as it plays
+			return stream;
+		}
+		// generate the whole cycle now so the audio thread only copies
+		// events out of an array
+		events.reset(new EventList);
+		MusicEvent event;
+		while (stream->Next(event)) {
+			events->push_back(event);
+		}
+	}
+	else if (!playing) {
+		return EventStreamSharedPtr();
+	}
+	else if (materialize) {
+		// one eager pass, so subgraphs the cycle uses more than once are
+		// only generated once
+		events = GenerateShared(playing, random, false);
+	}
+	else {
+		// a graph that does not compile can only be played lazily by
+		// generating on the audio thread, so an overlong cycle is cut
+		// off after the events that fit in memory instead
+		events.reset(new EventList);
+		EventStreamSharedPtr stream = playing->Stream(GenerationContext(random));
+		MusicEvent event;
+		while (stream && events->size() < MaxMaterializedEvents && stream->Next(event)) {
+			events->push_back(event);
+		}
+	}
+	count = events->size();
+	// the index lets the audio thread seek in the cycle
+	BeatIndexSharedPtr beats(new BeatIndex(EventView(events)));
+	return EventStreamSharedPtr(new EventListStream(EventView(events), beats));
+}
+
+}
+
+EventStreamSharedPtr Track::MakeCycleStream(Generator* root, GeneratorSharedPtr playing, ProgramSharedPtr program, bool materialize, const RandomStream& random)
+{
+	unsigned long count;
+	if (!IsProfiling()) {
+		return GenerateCycle(playing, program, materialize, random, count);
+	}
+	boost::int64_t start = GetProfileTicks();
+	boost::int64_t allocated = GetThreadAllocatedBytes();
+	EventStreamSharedPtr stream = GenerateCycle(playing, program, materialize, random, count);
+	// programs and the optimized copy do not count themselves on the
+	// script's graph. a cycle generated eagerly from root itself already
+	// did.
+	if (program || !materialize || playing.get() != root) {
+		root->RecordStats(GetProfileTicks() - start, count, GetThreadAllocatedBytes() - allocated);
+	}
+	return stream;
+}
+
+bool Track::Add(GeneratorSharedPtr gen, Quantization quantize, double startBeat)
+{
+	FreeRetiredParts();
+	if (livingParts_ >= MaxParts) {
+		return false;
+	}
+
+	PartLoopSharedPtr loop(new PartLoop(gen, random_.Split(partsAdded_)));
+	{
+		boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+		BuildPlaying(*loop);
+	}
+
+	// the first cycle is made here the way the lookahead thread makes the
+	// others, so the audio thread never generates. this is the script
+	// thread, which is the only one that edits graphs, so no lock is needed.
+	Part part = {quantize, gen, MakeCycleStream(gen.get(), loop->playing, loop->program, loop->materialize, loop->random.Split(0)), loop, 0, 0, 0, 0, false, 0};
+	if (startBeat > 0 && part.stream) {
+		// the stream is not shared yet, so it can be walked here when it
+		// can not seek
+		double wait;
+		if (!part.stream->Seek(startBeat, wait)) {
+			wait = SkipBeats(*part.stream, startBeat);
+		}
+		part.position = BeatsToTicks(wait);
+		part.cycleStart = -1;
+	}
+
+	Command command(COMMAND_ADD);
+	command.part = part;
+	if (!commands_.Push(command)) {
+		return false;
+	}
+	partsAdded_++;
+	livingParts_++;
+
+	{
+		boost::lock_guard<boost::mutex> lock(loopsMutex_);
+		loops_.push_back(loop);
+	}
+	lookaheadWake_.notify_all();
+	return true;
+}
+
+EventStreamSharedPtr Track::MakeCycle(PartLoop& loop, unsigned long cycle)
+{
+	GeneratorSharedPtr playing;
+	ProgramSharedPtr program;
+	bool materialize;
+	{
+		// only hold the lock while reading the graph, generating a long
+		// cycle under it would stall the script thread
+		boost::lock_guard<boost::recursive_mutex> lock(GetGraphMutex());
+		// the part was edited while it played, pick up the changes from
+		// this cycle on
+		if (loop.gen->GetVersion() != loop.version) {
+			BuildPlaying(loop);
+		}
+		playing = loop.playing;
+		program = loop.program;
+		materialize = loop.materialize;
+	}
+	return MakeCycleStream(loop.gen.get(), playing, program, materialize, loop.random.Split(cycle));
+}
+
+void Track::LookaheadLoop()
+{
+	for (;;)
+	{
+		vector<PartLoopSharedPtr> loops;
+		{
+			boost::lock_guard<boost::mutex> lock(loopsMutex_);
+			if (stopLookahead_) {
+				return;
+			}
+			// forget removed parts. this is where their memory gets freed.
+			for (unsigned long i=0; i<loops_.size(); ) {
+				if (!AtomicLoad(&loops_[i]->active)) {
+					loops_.erase(loops_.begin() + i);
 				}
 				else {
-					// wait time is smaller than window. use up remaining wait time.
-					timeUsed += part.waitTime;
-					timeUsedThisIteration = part.waitTime;
-					part.waitTime = 0;
+					i++;
 				}
 			}
-			else
-			{
-				// get the next event in the list
-				if (part.currentEvent >= part.events->size()) {
-					// TODO: remove the part
-					break;
+			loops = loops_;
+		}
+
+		for (unsigned long i=0; i<loops.size(); i++) {
+			PartLoop& loop = *loops[i];
+			long seekState = AtomicLoad(&loop.seekState);
+			if (seekState == SEEK_REQUESTED) {
+				EventStreamSharedPtr stream = MakeCycle(loop, loop.seekCycle);
+				double wait = 0;
+				if (stream && !stream->Seek(loop.seekBeat, wait)) {
+					wait = SkipBeats(*stream, loop.seekBeat);
 				}
-				ValueSharedPtr value = part.events->at(part.currentEvent);
-				part.currentEvent++;
-				if (!value) {
-					break;
+				loop.seekStream = stream;
+				loop.seekWait = wait;
+				AtomicStore(&loop.seekState, SEEK_READY);
+			}
+			else if (seekState == SEEK_IDLE && loop.seekStream) {
+				// what the part played before its last seek
+				loop.seekStream.reset();
+			}
+
+			if (AtomicLoad(&loop.state) != LOOP_EMPTY) {
+				continue;
+			}
+			loop.next = MakeCycle(loop, loop.nextCycle);
+			loop.nextCycle++;
+			AtomicStore(&loop.state, LOOP_READY);
+		}
+
+		// the audio thread never signals, so check back well within the
+		// length of a cycle
+		boost::unique_lock<boost::mutex> lock(loopsMutex_);
+		if (stopLookahead_) {
+			return;
+		}
+		lookaheadWake_.timed_wait(lock, boost::posix_time::milliseconds(10));
+	}
+}
+
+bool Track::Remove(GeneratorSharedPtr gen)
+{
+	FreeRetiredParts();
+	Command command(COMMAND_REMOVE);
+	command.gen = gen;
+	return commands_.Push(command);
+}
+
+bool Track::Clear()
+{
+	FreeRetiredParts();
+	Command command(COMMAND_CLEAR);
+	return commands_.Push(command);
+}
+
+bool Track::SetTempoScale(double scale)
+{
+	FreeRetiredParts();
+	if (!(scale > 0)) {
+		return false;
+	}
+	Command command(COMMAND_TEMPO_SCALE);
+	command.scale = scale;
+	return commands_.Push(command);
+}
+
+Ticks Track::ScaleTicks(Ticks ticks, double scale)
+{
+	if (scale == 1) {
+		return ticks;
+	}
+	return static_cast<Ticks>(floor(ticks / scale + 0.5));
+}
+
+bool Track::Seek(double beat)
+{
+	FreeRetiredParts();
+	Command command(COMMAND_SEEK);
+	command.beat = beat;
+	return commands_.Push(command);
+}
+
+void Track::FreeRetiredParts()
+{
+	while (Part* part = retiredParts_.Front()) {
+		*part = Part();
+		retiredParts_.Pop();
+		livingParts_--;
+	}
+}
+
+void Track::RetirePart(vector<Part>::iterator part)
+{
+	AtomicStore(&part->loop->active, 0);
+	// livingParts_ keeps the ring from filling up. the copy in the ring
+	// holds the last references, so the erase frees nothing here.
+	retiredParts_.Push(*part);
+	parts_.erase(part);
+}
+
+void Track::AddPart(Part& part, SampleTime start)
+{
+	// swap the part out of its command slot, so the references it holds
+	// stay counted without copying the stream or loop
+	parts_.push_back(Part());
+	Part& added = parts_.back();
+	swap(added, part);
+	// the part waits in the list until the transport reaches its boundary
+	added.origin = transport_.NextBoundary(transport_.ToTicks(start), added.quantize);
+}
+
+void Track::RunCommands(SampleTime blockStart, SampleTime blockEnd)
+{
+	while (Command* command = commands_.Front()) {
+		if (command->time > blockStart && command->time >= blockEnd) {
+			// for a later block
+			return;
+		}
+		SampleTime start = std::max(command->time, blockStart);
+
+		switch (command->type) {
+			case COMMAND_ADD:
+				AddPart(command->part, start);
+				break;
+			case COMMAND_REMOVE:
+				for (vector<Part>::iterator i = parts_.begin(); i != parts_.end(); i++) {
+					if (i->gen == command->gen) {
+						RetirePart(i);
+						break;
+					}
+				}
+				break;
+			case COMMAND_CLEAR:
+				while (!parts_.empty()) {
+					RetirePart(parts_.end() - 1);
 				}
-				else if (Music::NoteSharedPtr* note = boost::get<NoteSharedPtr>(value.get())) 
-				{
-					NoteSharedPtr n = *note;
-					ActiveNote newActiveNote;
-					newActiveNote.pitch = n->pitch;
-					// timeUsed is added to active note length because we subtract entire 
-					// window size when udpating active notes
-					newActiveNote.timeLeft = BeatsToMilliseconds(n->length) + timeUsed;
-
-					map<short, ActiveNote>::iterator activeNoteIter = activeNotes_.find(n->pitch);
-					if (activeNoteIter != activeNotes_.end()) {
-						// note is already on, turn it off
-						NoteOffEvent noteOffEvent;
-						noteOffEvent.pitch = n->pitch;
-						events.push_back(noteOffEvent);
-						offsets.push_back(timeUsed);
-
-						// replace currently active note at this pitch
-						ActiveNote& activeNote = activeNoteIter->second;
-						activeNote = newActiveNote;
+				break;
+			case COMMAND_SEEK:
+				for (vector<Part>::iterator i = parts_.begin(); i != parts_.end(); i++) {
+					if (!i->stream) {
+						continue;
+					}
+					i->origin = transport_.ToTicks(start);
+					i->cycleStart = -1;
+					// cycles held in memory carry a beat index. walking any
+					// other stream to beat takes as long as the walk, so the
+					// lookahead thread does it and the part stays silent
+					// until it hands the stream over.
+					double wait;
+					if (i->stream->SeeksInPlace() && i->stream->Seek(command->beat, wait)) {
+						i->position = BeatsToTicks(wait);
+						i->seeking = false;
 					}
 					else {
-						// new active note
-						activeNotes_[n->pitch] = newActiveNote;
+						i->position = 0;
+						i->seeking = true;
+						i->seekBeat = command->beat;
+						TakeSeek(*i);
 					}
-					NoteOnEvent noteOnEvent;
-					noteOnEvent.pitch = n->pitch;
-					noteOnEvent.velocity = n->velocity;
-					events.push_back(noteOnEvent);
-					offsets.push_back(timeUsed);
 				}
-				else if (Music::RestSharedPtr* rest = boost::get<RestSharedPtr>(value.get())) {
-					RestSharedPtr r = *rest;
-					part.waitTime += BeatsToMilliseconds(r->length);
+				break;
+			case COMMAND_TEMPO_SCALE:
+				for (vector<Part>::iterator i = parts_.begin(); i != parts_.end(); i++) {
+					// keep the next event of every part where it was
+					i->origin += ScaleTicks(i->position, tempoScale_) - ScaleTicks(i->position, command->scale);
 				}
-			}
+				tempoScale_ = command->scale;
+				break;
 		}
-		i++;
+		// whatever is left in the slot is released when the script thread
+		// reuses it
+		commands_.Pop();
 	}
+}
+
+namespace
+{
+
+// index of the lowest set bit. word must not be 0.
+inline int CountTrailingZeros(boost::uint32_t word)
+{
+#ifdef _WIN32
+	unsigned long index;
+	_BitScanForward(&index, word);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(word);
+#endif
+}
+
+}
 
-	// update active notes
-	for (it = activeNotes_.begin(); it != activeNotes_.end(); ) {
-		ActiveNote& activeNote = it->second;
-		if (elapsedTime >= activeNote.timeLeft) {
-			// if at the end of the buffer, wait until next update to generate note off
-			if (elapsedTime == activeNote.timeLeft) {
-				activeNote.timeLeft = 0;
-				it++;
+void Track::EndNotes(SampleTime blockStart, SampleTime blockEnd, vector<Event>& events, vector<unsigned long>& offsets)
+{
+	// walk the sounding pitches in order, one set bit at a time
+	for (int w=0; w<ActiveMaskWords; w++) {
+		boost::uint32_t word = activeMask_[w];
+		while (word) {
+			int pitch = w * 32 + CountTrailingZeros(word);
+			word &= word - 1;
+			SampleTime end = activeEnd_[pitch];
+			// a note that ends right at the end of the block gets its note
+			// off at the start of the next one
+			if (end >= blockEnd) {
 				continue;
 			}
-			// generate note off event
 			NoteOffEvent off;
-			off.pitch = activeNote.pitch;
+			off.pitch = static_cast<short>(pitch);
 			events.push_back(off);
-			offsets.push_back(activeNote.timeLeft);
+			offsets.push_back(end > blockStart ? static_cast<unsigned long>(end - blockStart) : 0);
+			activeMask_[w] &= ~(static_cast<boost::uint32_t>(1) << (pitch & 31));
+		}
+	}
+}
 
-			// remove active note
-			map<short, ActiveNote>::iterator removeIt = it;
-			it++;
-			activeNotes_.erase(removeIt);
+bool Track::TakeSeek(Part& part)
+{
+	PartLoop& loop = *part.loop;
+	long state = AtomicLoad(&loop.seekState);
+	if (state == SEEK_READY) {
+		if (loop.seekBeat == part.seekBeat && loop.seekCycle == part.cycle) {
+			part.stream.swap(loop.seekStream);
+			part.position = BeatsToTicks(loop.seekWait);
+			part.seeking = false;
+			AtomicStore(&loop.seekState, SEEK_IDLE);
+			return true;
+		}
+		// seeked for an earlier command, ask again
+		state = SEEK_IDLE;
+	}
+	if (state == SEEK_IDLE) {
+		loop.seekBeat = part.seekBeat;
+		loop.seekCycle = part.cycle;
+		AtomicStore(&loop.seekState, SEEK_REQUESTED);
+	}
+	return false;
+}
+
+void Track::Update(SampleTime blockStart, unsigned long frames, vector<Event>& events, vector<unsigned long>& offsets)
+{
+	SampleTime blockEnd = blockStart + frames;
+	RunCommands(blockStart, blockEnd);
+
+	EndNotes(blockStart, blockEnd, events, offsets);
+
+	for (unsigned long p=0; p<parts_.size(); )
+	{
+		Part& part = parts_[p];
+		if (part.seeking && !TakeSeek(part)) {
+			p++;
+			continue;
+		}
+		bool finished = false;
+		for (;;)
+		{
+			SampleTime due = transport_.ToSamples(part.origin + ScaleTicks(part.position, tempoScale_));
+			if (due >= blockEnd) {
+				break;
+			}
+			if (due < blockStart) {
+				// the part stalled waiting for its next cycle. carry on from
+				// here rather than rush out the notes it missed.
+				part.origin = transport_.ToTicks(blockStart) - ScaleTicks(part.position, tempoScale_);
+				continue;
+			}
+
+			// pull the next event from the stream
+			MusicEvent event;
+			if (!part.stream || !part.stream->Next(event)) {
+				PartLoop& loop = *part.loop;
+				if (part.position == part.cycleStart && !AtomicLoad(&loop.takesTime)) {
+					// no cycle of the part takes any time, looping it would
+					// sound it again on every update. one that only rolled
+					// empty this time just moves on to the next.
+					finished = true;
+					break;
+				}
+				// start the next cycle if the lookahead thread has it ready.
+				// otherwise stay silent and try again on the next update.
+				if (AtomicLoad(&loop.state) != LOOP_READY) {
+					break;
+				}
+				part.stream.swap(loop.next);
+				part.cycleStart = part.position;
+				part.cycle++;
+				AtomicStore(&loop.state, LOOP_EMPTY);
+				continue;
+			}
+
+			Ticks length = std::max(BeatsToTicks(event.length), static_cast<Ticks>(0));
+			if (event.type == NOTE_EVENT && event.pitch >= 0 && event.pitch < NumMidiPitches)
+			{
+				unsigned long offset = static_cast<unsigned long>(due - blockStart);
+				boost::uint32_t& word = activeMask_[event.pitch >> 5];
+				boost::uint32_t bit = static_cast<boost::uint32_t>(1) << (event.pitch & 31);
+				if (word & bit) {
+					// note is already on, turn it off
+					NoteOffEvent noteOffEvent;
+					noteOffEvent.pitch = event.pitch;
+					events.push_back(noteOffEvent);
+					offsets.push_back(offset);
+				}
+				// replace currently active note at this pitch. the end is
+				// worked out on the transport grid like its start.
+				word |= bit;
+				activeEnd_[event.pitch] = transport_.ToSamples(part.origin + ScaleTicks(part.position + length, tempoScale_));
+
+				NoteOnEvent noteOnEvent;
+				noteOnEvent.pitch = event.pitch;
+				noteOnEvent.velocity = event.velocity;
+				events.push_back(noteOnEvent);
+				offsets.push_back(offset);
+			}
+			else if (event.type == REST_EVENT) {
+				part.position += length;
+			}
+		}
+
+		if (finished) {
+			RetirePart(parts_.begin() + p);
 		}
 		else {
-			activeNote.timeLeft -= elapsedTime;
-			it++;
+			p++;
 		}
 	}
+
+	EndNotes(blockStart, blockEnd, events, offsets);
 }
 
 }
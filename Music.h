@@ -6,9 +6,14 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <boost/variant.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/thread.hpp>
+#include "Random.h"
+#include "Pool.h"
+#include "RingBuffer.h"
 
 namespace Music
 {
@@ -34,30 +39,526 @@ enum Quantization
 
 unsigned short GetMidiPitch(Scale scale, int octave, int degree);
 const char* GetScaleName(Scale scale);
-float BeatsToMilliseconds(float beats);
+short GetPitchFromString(const std::string& str);
 
-struct Note
+///////////////////////////
+// Timeline
+///////////////////////////
+// Tracks schedule on integer clocks, so a set can run for hours without
+// drifting. A part counts its position in ticks, fractions of a beat fine
+// enough to hold the lengths scripts use exactly, and ticks turn into
+// sample frames through the tempo map. Sample times are always worked out
+// from where the part started, never added up block by block, so rounding
+// does not build up and the same song plays the same whatever the block
+// size, live or offline.
+
+// Sample frames since the song started
+typedef boost::int64_t SampleTime;
+// Beats times TicksPerBeat
+typedef boost::int64_t Ticks;
+
+// divides by 1024, 3 and 5, so triplets and quintuplets are exact
+const Ticks TicksPerBeat = 15360;
+
+// Nearest tick to a number of beats
+Ticks BeatsToTicks(double beats);
+
+// Converts ticks to sample frames at a fixed tempo. The tempo is held to a
+// thousandth of a beat per minute.
+class TickRate
+{
+public:
+	TickRate(unsigned long sampleRate, double bpm);
+
+	// First sample frame at or after ticks. ticks must not be negative.
+	SampleTime ToSamples(Ticks ticks) const;
+	// First tick that falls at or after samples, the inverse of ToSamples
+	Ticks ToTicks(SampleTime samples) const;
+
+private:
+	// sample frames per tick as a fraction in lowest terms
+	boost::int64_t num_;
+	boost::int64_t den_;
+};
+
+///////////////////////////
+// Tempo map
+///////////////////////////
+// Tempo over the length of a song, as a list of segments that each hold a
+// tempo or ramp evenly from one tempo to the next. The sample frame every
+// segment starts on is worked out when the map is edited, so converting a
+// tick is a binary search for its segment plus one conversion inside it.
+// Held tempos convert exactly through a TickRate; ramps go through floating
+// point but always round the same way.
+//
+// The map also holds the time signature, as a list of meter changes that
+// each start on a bar line. Bars are counted on from the last change, so a
+// change never moves the bars before it.
+
+const double DefaultBpm = 120;
+const long DefaultBeatsPerBar = 4;
+
+class TempoMap
+{
+public:
+	explicit TempoMap(unsigned long sampleRate = 44100, double bpm = DefaultBpm);
+
+	// From tick on, ramp from the tempo at tick to bpm over rampTicks, then
+	// hold it. Changes after tick are dropped, the map before it is kept.
+	void SetTempo(Ticks tick, double bpm, Ticks rampTicks = 0);
+	double GetBpm(Ticks tick) const;
+
+	// First sample frame at or after ticks. ticks must not be negative.
+	SampleTime ToSamples(Ticks ticks) const;
+	// First tick that falls at or after samples
+	Ticks ToTicks(SampleTime samples) const;
+
+	unsigned long SegmentCount() const { return segments_.size(); }
+
+	// From the first bar line at or after tick on, bars are beats long.
+	// Changes after that bar line are dropped.
+	void SetBeatsPerBar(Ticks tick, long beats);
+	long GetBeatsPerBar(Ticks tick) const;
+	// Bar that tick falls in, counting from 0 at the start of the song, and
+	// how far into it tick is
+	long GetBar(Ticks tick, Ticks& intoBar) const;
+	// First bar line at or after tick
+	Ticks NextBar(Ticks tick) const;
+
+private:
+	struct Segment
+	{
+		Segment(Ticks s, SampleTime sample, unsigned long sampleRate, double from, double to, Ticks length) :
+			start(s), startSample(sample), rate(sampleRate, from), startBpm(from), endBpm(to), rampTicks(length) {}
+
+		Ticks start;
+		SampleTime startSample;
+		// held tempo, or the tempo at the start of a ramp
+		TickRate rate;
+		double startBpm;
+		double endBpm;
+		// 0 for a held tempo, which lasts until the next segment
+		Ticks rampTicks;
+	};
+
+	// index of the segment that plays ticks
+	unsigned long FindTicks(Ticks ticks) const;
+	// index of the last segment that starts before samples
+	unsigned long FindSamples(SampleTime samples) const;
+	SampleTime RampToSamples(const Segment& segment, Ticks ticks) const;
+
+	struct Meter
+	{
+		Meter(Ticks s, long b, long beats) : start(s), bar(b), beatsPerBar(beats) {}
+
+		// always on a bar line of the meter before
+		Ticks start;
+		// number of the bar that starts there
+		long bar;
+		long beatsPerBar;
+	};
+
+	// index of the meter in effect at ticks
+	unsigned long FindMeter(Ticks ticks) const;
+
+	unsigned long sampleRate_;
+	std::vector<Segment> segments_;
+	std::vector<Meter> meters_;
+};
+
+///////////////////////////
+// Transport
+///////////////////////////
+// The song clock every track plays against: where playback is, the tempo
+// and the time signature. Parts are placed on its grid of ticks, so parts
+// launched on the same beat or bar on different tracks start on the same
+// sample frame and stay there.
+//
+// The script edits its own copy of the tempo map and publishes it through
+// three slots handed back and forth with single atomic exchanges, so the
+// audio thread picks up a new map without waiting, copying or freeing.
+class Transport
+{
+public:
+	explicit Transport(unsigned long sampleRate);
+
+	// Audio thread. Picks up the last tempo map the script published; call
+	// before the tracks play a block.
+	void BeginBlock();
+	// Audio thread. Conversions through the tempo map in use.
+	SampleTime ToSamples(Ticks ticks) const { return maps_[front_].ToSamples(ticks); }
+	Ticks ToTicks(SampleTime samples) const { return maps_[front_].ToTicks(samples); }
+
+	// Script thread. Change the tempo to bpm on the next beat, ramping to it
+	// over rampBeats. Beats already played keep their tempo.
+	void SetTempo(double bpm, double rampBeats = 0);
+	// Script thread. Make bars beats long from the next bar line on. Bars
+	// already played keep their length.
+	void SetBeatsPerBar(long beats);
+	// Script thread. The tempo map as the script last set it.
+	const TempoMap& GetTempoMap() const { return edited_; }
+
+	// Audio thread. First beat or bar boundary at or after ticks, with bars
+	// from the map in use. NONE gives ticks back.
+	Ticks NextBoundary(Ticks ticks, Quantization quantize) const;
+
+	// Sample frame the audio thread is about to play, moved on by it after
+	// every block
+	SampleTime GetPosition() const;
+	void Advance(unsigned long frames);
+
+private:
+	// set in middle_ when it holds a map the audio thread has not seen
+	static const long NewMap = 4;
+
+	TempoMap maps_[3];
+	// slot the audio thread reads, only touched by it
+	long front_;
+	// slot the script writes next, only touched by it
+	long back_;
+	// the third slot, swapped with one of the others
+	volatile long middle_;
+	TempoMap edited_;
+
+	// first sample frame the audio thread can not have played yet
+	SampleTime GetSafePosition() const;
+	// hand edited_ over to the audio thread
+	void Publish();
+
+	volatile boost::int64_t position_;
+	// length of the last block, how far ahead of the position the audio
+	// thread may already be
+	volatile long blockFrames_;
+};
+
+// A pitch string such as "C_MAJ_4_1" resolved into an index into a table of
+// every (root, scale, octave, degree), so looking up the pitch is a single
+// array access.
+struct PitchSpec
+{
+	unsigned short index;
+};
+
+// Octaves and degrees are single digits in pitch strings
+const int NumPitchOctaves = 10;
+const int NumPitchDegrees = 10;
+// Valid PitchSpec indices are below this
+const int PitchTableSize = NumScales * 12 * NumPitchOctaves * NumPitchDegrees;
+
+// Returns false if the string can not be represented by a PitchSpec,
+// including pitches above the midi range
+bool ParsePitchSpec(const std::string& str, PitchSpec& spec);
+short GetPitch(PitchSpec spec);
+
+// Lookup table from every midi pitch to a new pitch
+const int NumMidiPitches = 128;
+struct PitchMap
+{
+	short pitches[NumMidiPitches];
+};
+
+// Build a map that moves each pitch to the nearest note of the scale
+// (rounding down on ties), then degrees notes up or down the scale
+void BuildScaleMap(Scale scale, int root, int degrees, PitchMap& map);
+// Parse a scale string such as "C_MAJ". Returns false if the string has no
+// scale in it.
+bool ParseScale(const std::string& str, Scale& scale, short& root);
+
+// Seed taken from the clock, for when the script does not pick one. Every
+// call returns a different seed.
+boost::uint64_t GetClockSeed();
+
+enum EventType
+{
+	NOTE_EVENT,
+	REST_EVENT
+};
+
+// Notes and rests are packed into a single 8 byte POD so they can be stored
+// by value in contiguous arrays. A rest only uses the length field.
+struct MusicEvent
 {
 	short pitch;
-	short velocity;
+	unsigned char velocity;
+	unsigned char type;
 	float length;
 };
 
-struct Rest
+// allocated from the pool, so generator stats see what building one costs
+typedef std::vector<MusicEvent, PoolAllocator<MusicEvent> > EventList;
+typedef boost::shared_ptr<EventList> EventListSharedPtr;
+typedef boost::shared_ptr<const EventList> ConstEventListSharedPtr;
+
+// Read only view of events stored elsewhere, either in an event list or in
+// a mapped file. owner keeps the storage alive for as long as the view is.
+struct EventView
 {
-	float length;
+	EventView() : data(NULL), size(0) {}
+	EventView(ConstEventListSharedPtr events) :
+		data(events && !events->empty() ? &(*events)[0] : NULL), size(events ? events->size() : 0), owner(events) {}
+	EventView(const MusicEvent* d, unsigned long s, boost::shared_ptr<const void> o) : data(d), size(s), owner(o) {}
+
+	const MusicEvent* data;
+	unsigned long size;
+	boost::shared_ptr<const void> owner;
+};
+
+// Output buffer that generators append their events to. The caller owns the
+// list and can clear and reuse it between passes, so a pass only allocates
+// when the list has to grow.
+class EventSink
+{
+public:
+	explicit EventSink(EventList& events) : events_(events) {}
+
+	void Add(const MusicEvent& event) { events_.push_back(event); }
+	void Add(const MusicEvent* events, unsigned long count) { events_.insert(events_.end(), events, events + count); }
+	void Add(const EventList& events) { events_.insert(events_.end(), events.begin(), events.end()); }
+
+	unsigned long Size() const { return events_.size(); }
+	// Events from index on, for generators that rewrite what their children added
+	MusicEvent* At(unsigned long index) { return &events_[index]; }
+	void Truncate(unsigned long size) { events_.resize(size); }
+	const EventList& Events() const { return events_; }
+
+private:
+	EventList& events_;
 };
 
-typedef boost::shared_ptr<Note> NoteSharedPtr;
-typedef boost::shared_ptr<Rest> RestSharedPtr;
+MusicEvent MakeNoteEvent(short pitch, short velocity, float length);
+MusicEvent MakeRestEvent(float length);
 
-typedef boost::variant<std::string, int, float, NoteSharedPtr, RestSharedPtr> Value;
-typedef boost::shared_ptr<Value> ValueSharedPtr;
+// Reference count for objects that are made, passed around and dropped on
+// one thread, like the values handed between generators within a pass. The
+// count is a plain integer held in the object, so copying a pointer costs no
+// atomic operation and making an object costs a single pool allocation.
+// Objects held this way must not be shared between threads; generators and
+// event lists, which are, stay behind shared_ptr.
+template <class T>
+class LocalCounted : public T
+{
+public:
+	LocalCounted() : refs_(0) {}
+	explicit LocalCounted(const T& value) : T(value), refs_(0) {}
+
+	static void* operator new(std::size_t bytes) { return PoolAllocate(bytes); }
+	static void operator delete(void* block, std::size_t bytes) { PoolFree(block, bytes); }
+
+	friend void intrusive_ptr_add_ref(LocalCounted* object) { object->refs_++; }
+	friend void intrusive_ptr_release(LocalCounted* object)
+	{
+		if (--object->refs_ == 0) {
+			delete object;
+		}
+	}
+
+private:
+	LocalCounted(const LocalCounted&);
+	LocalCounted& operator=(const LocalCounted&);
+
+	long refs_;
+};
+
+// Values are the parameters fed into note and rest generators
+typedef boost::variant<std::string, int, float, PitchSpec> Value;
+typedef boost::intrusive_ptr<LocalCounted<Value> > ValueSharedPtr;
 
 class Generator;
 typedef boost::shared_ptr<Generator> GeneratorSharedPtr;
-typedef std::vector<ValueSharedPtr> ValueList;
-typedef boost::shared_ptr<ValueList> ValueListSharedPtr;
+typedef std::vector<ValueSharedPtr, PoolAllocator<ValueSharedPtr> > ValueList;
+typedef boost::intrusive_ptr<LocalCounted<ValueList> > ValueListSharedPtr;
+
+inline ValueSharedPtr MakeValue(const Value& value)
+{
+	return ValueSharedPtr(new LocalCounted<Value>(value));
+}
+
+inline ValueListSharedPtr MakeValueList()
+{
+	return ValueListSharedPtr(new LocalCounted<ValueList>);
+}
+
+///////////////////////////
+// Generation context
+///////////////////////////
+// State threaded through a generation pass. Each subtree of a pattern is
+// generated with its own split of the random stream, so its output only
+// depends on where it sits in the pattern and not on what was generated
+// before it.
+class GenerationCache;
+class TaskPool;
+
+struct GenerationContext
+{
+	GenerationContext(const RandomStream& randomStream = RandomStream()) : random(randomStream), cache(NULL), pool(NULL), reuseOutputs(false) {}
+
+	RandomStream random;
+	// output of shared subgraphs, kept for the length of one pass. owned by
+	// whoever starts the pass, copies of the context only borrow it.
+	GenerationCache* cache;
+	// when set, patterns hand their items to worker threads
+	TaskPool* pool;
+	// when set, generators keep their output between passes and hand it out
+	// again for the same random stream until they are invalidated
+	bool reuseOutputs;
+};
+
+///////////////////////////
+// Generation cache
+///////////////////////////
+// Before a pass, the graph is walked to find nodes that will be generated
+// more than once, either because several parents reference the same
+// GeneratorSharedPtr or because they sit under a repeated pattern. The first
+// output of such a node is kept and copied for every later use in the pass.
+// Only subgraphs without random choices are shared, unless shared randomness
+// is asked for, in which case every use of a random subgraph within the pass
+// also gets the same result. The cache can be used from several threads.
+//
+// Passes that use a cache are MakeStatic, GenerateShared and the cycles of
+// playing parts whose graph does not compile. Compiled programs are not
+// memoized: they share the code of a reused pattern body, but run it again
+// at every use.
+class GenerationCache
+{
+public:
+	GenerationCache(Generator* root, bool sharedRandomness);
+
+	bool IsShared(const Generator* gen) const { return shared_.find(gen) != shared_.end(); }
+	bool SharesRandomness() const { return sharedRandomness_; }
+	// True if nothing under gen makes a random choice
+	bool IsDeterministic(const Generator* gen) const { return deterministic_.find(gen) != deterministic_.end(); }
+	// True for the root of the pass and the tops of the largest subgraphs
+	// without random choices
+	bool IsSubtreeRoot(const Generator* gen) const { return subtreeRoots_.find(gen) != subtreeRoots_.end(); }
+	ConstEventListSharedPtr Find(const Generator* gen);
+	// Keep the output of gen unless another thread got there first. Returns
+	// the output that was kept.
+	ConstEventListSharedPtr Store(const Generator* gen, ConstEventListSharedPtr events);
+
+private:
+	bool sharedRandomness_;
+	std::set<const Generator*> shared_;
+	std::set<const Generator*> deterministic_;
+	std::set<const Generator*> subtreeRoots_;
+	std::map<const Generator*, ConstEventListSharedPtr> results_;
+	boost::mutex mutex_;
+};
+
+// Generate a whole graph in one pass, sharing the output of reused subgraphs.
+// If a pool is given, large patterns are generated on its worker threads.
+EventListSharedPtr GenerateShared(GeneratorSharedPtr gen, const RandomStream& random, bool sharedRandomness, TaskPool* pool = NULL);
+
+class ProgramBuilder;
+class GraphWriter;
+class GraphOptimizer;
+class Program;
+typedef boost::shared_ptr<Program> ProgramSharedPtr;
+
+// Note parameters that a generator value can be compiled into
+enum ParameterRegister
+{
+	PITCH_REGISTER,
+	VELOCITY_REGISTER,
+	LENGTH_REGISTER
+};
+bool CompileConstant(ProgramBuilder& builder, ParameterRegister reg, const Value& value);
+bool SaveConstant(GraphWriter& writer, const Value& value, boost::uint32_t& index);
+
+///////////////////////////
+// Event stream
+///////////////////////////
+// Pull based cursor over the output of a generator. Events are produced one
+// at a time on demand, so the memory held by a stream does not depend on the
+// length of the pattern being played.
+class EventStream
+{
+public:
+	virtual ~EventStream() {}
+	// Fetch the next event. Returns false once the stream is exhausted.
+	virtual bool Next(MusicEvent& event) = 0;
+
+	// Move to the first event that starts at or after beat, counted from the
+	// start of the stream. wait is set to the time from beat until that
+	// event starts, which is what is left of the rest beat falls in. Streams
+	// that can not seek return false and stay where they are.
+	virtual bool Seek(double beat, double& wait) { return false; }
+	// True if Seek is a lookup rather than a walk through the stream, so
+	// it takes the same time wherever beat is
+	virtual bool SeeksInPlace() const { return false; }
+};
+typedef boost::shared_ptr<EventStream> EventStreamSharedPtr;
+
+// Move a stream forward by beats from where it is, one event at a time.
+// Returns what is left of the rest it stopped in.
+double SkipBeats(EventStream& stream, double beats);
+
+///////////////////////////
+// Beat index
+///////////////////////////
+// Start of every event of a sequence in beats. Notes take no time of their
+// own and rests move time on by their length, so an event starts at the sum
+// of the rests before it. Finding the event at a beat is a binary search.
+class BeatIndex
+{
+public:
+	explicit BeatIndex(const EventView& events);
+
+	double Start(unsigned long index) const { return starts_[index]; }
+	double Length() const { return starts_.back(); }
+
+	// Index of the first event that starts at or after beat, or the number
+	// of events if there is none. wait is the time from beat until then.
+	unsigned long Find(double beat, double& wait) const;
+
+private:
+	// one per event, then the length of the whole sequence
+	std::vector<double> starts_;
+};
+typedef boost::shared_ptr<const BeatIndex> BeatIndexSharedPtr;
+
+// Stream over already generated events. Seeking needs a beat index, which
+// is built up front by whoever makes the stream: building it on the first
+// seek could put the work on the audio thread.
+class EventListStream : public EventStream
+{
+public:
+	EventListStream(const EventView& events, BeatIndexSharedPtr beats = BeatIndexSharedPtr()) : events_(events), beats_(beats), index_(0) {}
+	virtual bool Next(MusicEvent& event);
+	virtual bool Seek(double beat, double& wait);
+	virtual bool SeeksInPlace() const { return beats_.get() != 0; }
+
+private:
+	EventView events_;
+	BeatIndexSharedPtr beats_;
+	unsigned long index_;
+};
+
+///////////////////////////
+// Profiling
+///////////////////////////
+// While profiling is on, every generator counts its calls, the events or
+// values it returned and the time spent in it including its children.
+// Counters are updated atomically, so passes run on the worker pool are
+// counted too. Compiled programs and streams do not call back into the
+// graph, so the cycles a track makes of a part are counted on the graph
+// the part was added with.
+void SetProfiling(bool enabled);
+bool IsProfiling();
+
+struct GeneratorStats
+{
+	GeneratorStats() : calls(0), items(0), ticks(0), allocatedBytes(0) {}
+
+	boost::int64_t calls;
+	// events or values returned
+	boost::int64_t items;
+	boost::int64_t ticks;
+	// bytes taken from the pool while the generator ran, children included.
+	// Work handed to worker threads counts on the nodes run there.
+	boost::int64_t allocatedBytes;
+};
+
+double ProfileTicksToMilliseconds(boost::int64_t ticks);
 
 ///////////////////////////
 // Generator base class
@@ -65,10 +566,114 @@ typedef boost::shared_ptr<ValueList> ValueListSharedPtr;
 class Generator
 {
 public:
-	Generator() {}
-	virtual ValueListSharedPtr Generate() = 0;
+	Generator() : version_(0) {}
+	virtual ~Generator() {}
+
+	// Generate parameter values (pitch, velocity, length, scale)
+	ValueListSharedPtr Generate(GenerationContext& context);
+
+	// Generate notes and rests, appending them to sink. Every node of the
+	// graph appends straight into the same sink. Subgraphs that are shared
+	// within a pass are served from the context's cache.
+	void GenerateInto(GenerationContext& context, EventSink& sink);
+	// Generate into a new list
+	EventListSharedPtr GenerateEvents(GenerationContext& context);
+
+	// Create a cursor that generates events lazily. By default the whole
+	// output is generated up front and iterated.
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+
+	// Lower this generator into program instructions (see Program.h).
+	// Generators that do not know how to compile themselves return false.
+	virtual bool Compile(ProgramBuilder& builder) { return false; }
+	virtual bool CompileValue(ProgramBuilder& builder, ParameterRegister reg) { return false; }
+
+	// Add this generator to a graph file (see GraphFile.h), children first.
+	// Generators that can not be saved return false.
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const { return false; }
+
+	// Generate once with the given random stream and freeze the result into
+	// a StaticSequenceGenerator. With reuseOutputs, subgraphs that have not
+	// changed since an earlier call with the same stream are not generated
+	// again, and subgraphs without random choices are reused for any stream.
+	// Output is kept at the root, at the tops of subgraphs without random
+	// choices and wherever it is large.
+	GeneratorSharedPtr MakeStatic(const RandomStream& random, bool sharedRandomness = false, TaskPool* pool = NULL, bool reuseOutputs = false);
+
+	// Return a cheaper generator that produces the same events for every
+	// random stream, built from children optimized through optimizer, or
+	// null if this node can not be improved (see Optimize.h)
+	virtual GeneratorSharedPtr Optimize(GraphOptimizer& optimizer) { return GeneratorSharedPtr(); }
+
+	// Children of this node in the generator graph
+	virtual void GetChildren(std::vector<Generator*>& children) const {}
+	// True if this node itself makes random choices
+	virtual bool IsRandom() const { return false; }
+	// Number of times the children are generated per call
+	virtual unsigned long GetRepeat() const { return 1; }
+
+	// Name of the generator as scripts know it
+	virtual const char* Name() const { return "Generator"; }
+
+	GeneratorStats GetStats();
+	void ResetStats();
+	// Count a call made for this generator
+	void RecordStats(boost::int64_t ticks, unsigned long items, boost::int64_t allocatedBytes);
+
+	// Call after a parameter of this generator changes. Drops the kept
+	// output of this generator and of everything that depends on it, and
+	// bumps their versions. Untouched siblings keep their output.
+	void Invalidate();
+	// Changes whenever this generator or anything under it changes
+	long GetVersion() const;
+
+protected:
+	virtual ValueListSharedPtr DoGenerate(GenerationContext& context);
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
+
+	// Generators with children call Link at the end of their constructor and
+	// Unlink in their destructor, so children know who depends on them
+	void Link();
+	void Unlink();
+	// Swap a child for another one and invalidate
+	void ReplaceChild(GeneratorSharedPtr& child, GeneratorSharedPtr newChild);
+
+private:
+	void GenerateIntoShared(GenerationContext& context, EventSink& sink);
+	void GenerateIntoReused(GenerationContext& context, EventSink& sink);
+
+	GeneratorStats stats_;
+
+	// generators whose children include this one, once per reference
+	std::vector<Generator*> parents_;
+	volatile long version_;
+
+	// output kept for reuse, by the state of the random stream it was made
+	// with. output without random choices is kept once, whatever the stream.
+	struct KeptOutput
+	{
+		boost::uint64_t key;
+		boost::uint64_t counter;
+		// how far generating moved the stream on
+		boost::uint64_t advance;
+		ConstEventListSharedPtr events;
+	};
+	std::vector<KeptOutput> kept_;
+	// protects kept_
+	boost::mutex keptMutex_;
 };
 
+// Taken while the shape of a graph is read or changed from more than one
+// thread (the script thread edits graphs, the lookahead thread compiles them)
+boost::recursive_mutex& GetGraphMutex();
+
+// Print the stats of every node under root as an indented tree. Self time
+// is the node's time minus its children's, which is only an estimate for
+// nodes with shared children or children generated on other threads.
+void DumpStats(Generator* root, std::ostream& out);
+// Reset the stats of every node under root
+void ResetStats(Generator* root);
+
 ///////////////////////////
 // Single value generator
 ///////////////////////////
@@ -78,14 +683,27 @@ class SingleValueGenerator : public Generator
 public:
 	SingleValueGenerator(T val) : val_(val) {}
 
-	virtual ValueListSharedPtr Generate()
+	virtual bool CompileValue(ProgramBuilder& builder, ParameterRegister reg)
 	{
-		boost::shared_ptr<ValueList> result(new ValueList);
-		result->push_back(ValueSharedPtr(new Value(val_)));
-		return result;
+		return CompileConstant(builder, reg, Value(val_));
 	}
 
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const
+	{
+		return SaveConstant(writer, Value(val_), index);
+	}
+
+	virtual const char* Name() const { return "Value"; }
+
 	T val_;
+
+protected:
+	virtual ValueListSharedPtr DoGenerate(GenerationContext& context)
+	{
+		ValueListSharedPtr result = MakeValueList();
+		result->push_back(MakeValue(Value(val_)));
+		return result;
+	}
 };
 
 ///////////////////////////
@@ -95,8 +713,20 @@ class NoteGenerator : public Generator
 {
 public:
 	NoteGenerator(GeneratorSharedPtr pitchGen, GeneratorSharedPtr velocityGen, GeneratorSharedPtr lengthGen) : Generator(),
-					pitchGen_(pitchGen), velocityGen_(velocityGen), lengthGen_(lengthGen) {}
-	virtual ValueListSharedPtr Generate();
+					pitchGen_(pitchGen), velocityGen_(velocityGen), lengthGen_(lengthGen) { Link(); }
+	virtual ~NoteGenerator() { Unlink(); }
+
+	void SetPitch(GeneratorSharedPtr pitchGen) { ReplaceChild(pitchGen_, pitchGen); }
+	void SetVelocity(GeneratorSharedPtr velocityGen) { ReplaceChild(velocityGen_, velocityGen); }
+	void SetLength(GeneratorSharedPtr lengthGen) { ReplaceChild(lengthGen_, lengthGen); }
+
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual const char* Name() const { return "NoteGen"; }
+
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
 
 private:
 	GeneratorSharedPtr pitchGen_;
@@ -111,8 +741,17 @@ typedef boost::shared_ptr<NoteGenerator> NoteGenSharedPtr;
 class RestGenerator : public Generator
 {
 public:
-	RestGenerator(GeneratorSharedPtr lengthGen) : Generator(), lengthGen_(lengthGen) {}
-	virtual ValueListSharedPtr Generate();
+	RestGenerator(GeneratorSharedPtr lengthGen) : Generator(), lengthGen_(lengthGen) { Link(); }
+	virtual ~RestGenerator() { Unlink(); }
+
+	void SetLength(GeneratorSharedPtr lengthGen) { ReplaceChild(lengthGen_, lengthGen); }
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual const char* Name() const { return "RestGen"; }
+
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
 
 private:
 	GeneratorSharedPtr lengthGen_;
@@ -125,49 +764,173 @@ typedef boost::shared_ptr<RestGenerator> RestGenSharedPtr;
 class PatternGenerator : public Generator
 {
 public:
-	PatternGenerator(std::vector<GeneratorSharedPtr> items , unsigned long repeat) : Generator(), items_(items), repeat_(repeat) {}
-	virtual ValueListSharedPtr Generate();
+	PatternGenerator(std::vector<GeneratorSharedPtr> items , unsigned long repeat) : Generator(), items_(items), repeat_(repeat) { Link(); }
+	virtual ~PatternGenerator() { Unlink(); }
+
+	void SetRepeat(unsigned long repeat);
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+	virtual bool Compile(ProgramBuilder& builder);
+	bool CompileBody(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual GeneratorSharedPtr Optimize(GraphOptimizer& optimizer);
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual unsigned long GetRepeat() const { return repeat_; }
+	virtual const char* Name() const { return "PatternGen"; }
 
-	boost::shared_ptr<PatternGenerator> MakeStatic();
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
 
 private:
+	// generate items begin to end of the repeated item list, in order
+	void GenerateRange(GenerationContext context, unsigned long begin, unsigned long end, EventSink& sink);
+	// same, into a list of its own, for worker threads
+	void GenerateChunk(GenerationContext context, unsigned long begin, unsigned long end, EventList* out);
+
 	std::vector<GeneratorSharedPtr> items_;
 	unsigned long repeat_;
 };
 typedef boost::shared_ptr<PatternGenerator> PatternGenSharedPtr;
 
+///////////////////////////
+// Static sequence generator
+///////////////////////////
+// Plays back a frozen array of events. The array is immutable and shared by
+// every stream and program that plays it, so generating from it is a single
+// copy of contiguous memory.
+class StaticSequenceGenerator : public Generator
+{
+public:
+	StaticSequenceGenerator(const EventList& events) : Generator(), events_(ConstEventListSharedPtr(new EventList(events))) {}
+	// Play events in place, for example straight out of a mapped file
+	StaticSequenceGenerator(const EventView& events) : Generator(), events_(events) {}
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+
+	const EventView& GetEvents() const { return events_; }
+	// Built the first time it is asked for and shared by every stream after
+	BeatIndexSharedPtr GetBeatIndex() const;
+	virtual const char* Name() const { return "StaticPattern"; }
+
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
+
+private:
+	EventView events_;
+	mutable BeatIndexSharedPtr beats_;
+	mutable boost::mutex beatsMutex_;
+};
+typedef boost::shared_ptr<StaticSequenceGenerator> StaticSequenceGenSharedPtr;
+
+///////////////////////////
+// Alias table
+///////////////////////////
+// Vose's alias method. The table is built once from a list of weights, after
+// which drawing an index takes constant time however many weights there are.
+class AliasTable
+{
+public:
+	void Build(const std::vector<float>& weights);
+	bool Empty() const { return probability_.empty(); }
+
+	// Pick an index given a uniform random number in [0, 1)
+	unsigned long Sample(double random) const;
+
+private:
+	std::vector<float> probability_;
+	std::vector<unsigned long> alias_;
+};
+
 class WeightedGenerator : public Generator
 {
 public:
-	typedef std::pair<GeneratorSharedPtr, unsigned long> WeightedValue;
+	typedef std::pair<GeneratorSharedPtr, float> WeightedValue;
+
+	WeightedGenerator(const std::vector<WeightedValue>& values);
+	virtual ~WeightedGenerator() { Unlink(); }
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool CompileValue(ProgramBuilder& builder, ParameterRegister reg);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual GeneratorSharedPtr Optimize(GraphOptimizer& optimizer);
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual bool IsRandom() const;
+	virtual const char* Name() const { return "WeightGen"; }
 
-	WeightedGenerator(const std::vector<WeightedValue>& values) : values_(values) {}
-	virtual ValueListSharedPtr Generate();
+protected:
+	virtual ValueListSharedPtr DoGenerate(GenerationContext& context);
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
 
 private:
+	Generator* Choose(GenerationContext& context);
+	bool CompileChoice(ProgramBuilder& builder, bool events, ParameterRegister reg);
+
 	std::vector<WeightedValue> values_;
+	AliasTable table_;
 };
 typedef boost::shared_ptr<WeightedGenerator> WeightedGenPtr;
 
 class TransposeGenerator : public Generator
 {
 public:
-	typedef std::pair<GeneratorSharedPtr, unsigned long> WeightedValue;
+	// the scale is resolved here, once
+	TransposeGenerator(GeneratorSharedPtr gen, GeneratorSharedPtr scaleGen, int transposeAmount);
+	virtual ~TransposeGenerator() { Unlink(); }
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual GeneratorSharedPtr Optimize(GraphOptimizer& optimizer);
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual const char* Name() const { return "TransposeGen"; }
 
-	TransposeGenerator(GeneratorSharedPtr gen, GeneratorSharedPtr scaleGen, int transposeAmount) : gen_(gen), scaleGen_(scaleGen), transposeAmount_(transposeAmount) {}
-	virtual ValueListSharedPtr Generate();
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
 
 private:
+	bool GetTransposeInSemitones(int& semitones) const;
+
 	GeneratorSharedPtr gen_;
 	GeneratorSharedPtr scaleGen_;
 	int transposeAmount_;
+	bool valid_;
+	int semitones_;
 };
 typedef boost::shared_ptr<WeightedGenerator> WeightedGenPtr;
 
+///////////////////////////
+// Quantize generator
+///////////////////////////
+// Moves every note of another generator onto the nearest note of a scale,
+// optionally shifting it a number of degrees along the scale. Both steps
+// are folded into one 128 entry lookup table built when the generator is.
+class QuantizeGenerator : public Generator
+{
+public:
+	QuantizeGenerator(GeneratorSharedPtr gen, GeneratorSharedPtr scaleGen, int degrees = 0);
+	virtual ~QuantizeGenerator() { Unlink(); }
+	virtual EventStreamSharedPtr Stream(const GenerationContext& context);
+	virtual bool Compile(ProgramBuilder& builder);
+	virtual bool Save(GraphWriter& writer, boost::uint32_t& index) const;
+	virtual GeneratorSharedPtr Optimize(GraphOptimizer& optimizer);
+	virtual void GetChildren(std::vector<Generator*>& children) const;
+	virtual const char* Name() const { return "QuantizeGen"; }
+
+protected:
+	virtual void DoGenerateInto(GenerationContext& context, EventSink& sink);
+
+private:
+	GeneratorSharedPtr gen_;
+	GeneratorSharedPtr scaleGen_;
+	int degrees_;
+	bool valid_;
+	PitchMap map_;
+};
+
 class Track
 {
 public:
-	Track();
+	explicit Track(const Transport& transport);
+	~Track();
 
 	struct NoteOnEvent
 	{
@@ -180,36 +943,211 @@ public:
 	};
 	typedef boost::variant<NoteOnEvent, NoteOffEvent> Event;
 
-	void Add(GeneratorSharedPtr gen, Quantization quantize);
-	void Remove(GeneratorSharedPtr gen);
-	void Clear();
+	// Most parts a track holds, counting removed ones that have not been
+	// freed yet
+	static const unsigned long MaxParts = 256;
+	// Most commands sent and not yet picked up by Update
+	static const unsigned long MaxCommands = 256;
+
+	// Parts loop until removed. The first cycle is generated when the part
+	// is added, every later one on a background thread while the previous
+	// one plays. Parts play an
+	// optimized copy of their graph (see Optimize.h) that sounds the same.
+	// A part starts on the next beat or bar of the transport as quantize
+	// asks, and startBeat starts it part of the way into its first cycle.
+	// A part that can never take any time, such as a lone chord, plays once.
+	//
+	// These are sent to the audio thread as commands that the next Update
+	// carries out in the order they were sent. They return false, and do
+	// nothing, when the track is full or Update is not keeping up.
+	bool Add(GeneratorSharedPtr gen, Quantization quantize, double startBeat = 0);
+	bool Remove(GeneratorSharedPtr gen);
+	bool Clear();
+	// Move every part to beat within the cycle it is playing. Notes that
+	// start before beat are skipped, not played late. A part whose cycle is
+	// too long to hold in memory is silent for the moment it takes the
+	// lookahead thread to seek it.
+	bool Seek(double beat);
+	// Play the parts of this track scale times as fast as the transport's
+	// tempo. Parts carry on from where they are.
+	bool SetTempoScale(double scale);
+
+	// Parts added after this call are generated from random streams split
+	// off this seed, so playing the same script again gives the same result.
+	void Seed(boost::uint64_t seed);
 
-	void Update(float songTime, float elapsedTime, std::vector<Event>& events, std::vector<float>& offsets);
+	// Play the block of frames starting at blockStart. offsets are the
+	// sample frames into the block the events fall on.
+	void Update(SampleTime blockStart, unsigned long frames, std::vector<Event>& events, std::vector<unsigned long>& offsets);
 
 private:
 
+	enum LoopState
+	{
+		LOOP_EMPTY,		// lookahead thread owns next and is generating into it
+		LOOP_READY		// audio thread owns next and may swap it in
+	};
+
+	enum SeekState
+	{
+		SEEK_IDLE,		// lookahead thread owns seekStream, audio thread may ask for a seek
+		SEEK_REQUESTED,	// lookahead thread is seeking
+		SEEK_READY		// audio thread owns seekStream and may swap it in
+	};
+
+	// Lookahead state of a looping part, shared by the audio thread and the
+	// lookahead thread. The two threads hand next back and forth through
+	// state without locking, so the audio thread never waits on generation.
+	struct PartLoop
+	{
+		PartLoop(GeneratorSharedPtr g, const RandomStream& r) :
+			gen(g), version(0), materialize(true), takesTime(1), random(r), nextCycle(1), state(LOOP_EMPTY),
+			seekCycle(0), seekBeat(0), seekWait(0), seekState(SEEK_IDLE), active(1) {}
+
+		// graph as the script built it
+		GeneratorSharedPtr gen;
+		// optimized copy of gen that is actually played, and its program
+		GeneratorSharedPtr playing;
+		ProgramSharedPtr program;
+		// version of gen playing was built from
+		long version;
+		// cycles small enough to generate into memory ahead of time. longer
+		// ones are pulled straight from the program as they play, or cut
+		// short if the graph has no program.
+		bool materialize;
+		// cleared if no cycle of playing can take any time, so looping it
+		// would never move on. read by the audio thread.
+		volatile long takesTime;
+		// cycle n plays with random.Split(n)
+		RandomStream random;
+		unsigned long nextCycle;
+		// stream of the next cycle. the audio thread swaps its finished
+		// stream in here, so the old one is freed on the lookahead thread.
+		EventStreamSharedPtr next;
+		volatile long state;
+		// a stream that can not seek in place is not walked on the audio
+		// thread. the lookahead thread makes cycle seekCycle again, moves
+		// it to seekBeat and hands it over in seekStream along with what
+		// is left of the rest seekBeat falls in. the stream it replaces
+		// comes back the same way to be freed.
+		unsigned long seekCycle;
+		double seekBeat;
+		double seekWait;
+		EventStreamSharedPtr seekStream;
+		volatile long seekState;
+		// cleared by the audio thread when the part is removed
+		volatile long active;
+	};
+	typedef boost::shared_ptr<PartLoop> PartLoopSharedPtr;
+
+	// optimize and compile loop.gen. the graph mutex must be held.
+	static void BuildPlaying(PartLoop& loop);
+	// stream of one cycle, generated into memory up front if materialize.
+	// while profiling, making it is counted on root, the graph the part was
+	// added with.
+	static EventStreamSharedPtr MakeCycleStream(Generator* root, GeneratorSharedPtr playing, ProgramSharedPtr program, bool materialize, const RandomStream& random);
+	// make cycle of loop, rebuilding its graph first if it was edited
+	static EventStreamSharedPtr MakeCycle(PartLoop& loop, unsigned long cycle);
+	void LookaheadLoop();
+
 	struct Part
 	{
-		bool started;
-		float waitTime;
-		unsigned long currentEvent;
 		Quantization quantize;
 		GeneratorSharedPtr gen;
-		boost::shared_ptr<ValueList> events;
+		EventStreamSharedPtr stream;
+		PartLoopSharedPtr loop;
+		// the next event of the part plays at the transport tick origin +
+		// position, with position scaled by the track's tempo scale
+		Ticks origin;
+		Ticks position;
+		// position the playing cycle started at, or -1 if it was entered
+		// part of the way through
+		Ticks cycleStart;
+		// number of the playing cycle
+		unsigned long cycle;
+		// silent until the lookahead thread hands over the stream it
+		// seeked to seekBeat
+		bool seeking;
+		double seekBeat;
 	};
 
-	struct ActiveNote
+	enum CommandType
 	{
-		short pitch;
-		float timeLeft;
+		COMMAND_ADD,
+		COMMAND_REMOVE,
+		COMMAND_CLEAR,
+		COMMAND_SEEK,
+		COMMAND_TEMPO_SCALE
+	};
+
+	// Request from the script thread to the audio thread
+	struct Command
+	{
+		explicit Command(CommandType t = COMMAND_CLEAR) : type(t), time(0), part(), beat(0), scale(1) {}
+
+		CommandType type;
+		// sample the command takes effect at. Update holds back commands
+		// stamped past the end of its block; commands sent from the script
+		// are stamped 0 and so take effect at the start of the next one.
+		SampleTime time;
+		// part to add, swapped out of the slot by the audio thread
+		Part part;
+		// part to remove
+		GeneratorSharedPtr gen;
+		// beat to seek to
+		double beat;
+		// new tempo scale
+		double scale;
 	};
-	std::list<Part> parts_;
-	std::map<short, ActiveNote> activeNotes_;
 
-	bool clearRequested_;
-	bool addPartRequested_;
-	Part addPart_;
-	GeneratorSharedPtr removeRequest_;
+	// run by Update at the start of a block
+	void RunCommands(SampleTime blockStart, SampleTime blockEnd);
+	void AddPart(Part& part, SampleTime start);
+	// hand a part that stopped playing back to the script thread to free
+	void RetirePart(std::vector<Part>::iterator part);
+	// ask the lookahead thread to seek a part, or take the stream it
+	// seeked. returns true once the part has it.
+	static bool TakeSeek(Part& part);
+	// free retired parts. script thread only.
+	void FreeRetiredParts();
+
+	// send note offs for notes that end within the block
+	void EndNotes(SampleTime blockStart, SampleTime blockEnd, std::vector<Event>& events, std::vector<unsigned long>& offsets);
+
+	// ticks of the transport a part position covers at the given scale
+	static Ticks ScaleTicks(Ticks ticks, double scale);
+
+	const Transport& transport_;
+	// only touched by the audio thread
+	double tempoScale_;
+
+	// room for MaxParts is reserved up front, so adding a part never
+	// allocates on the audio thread
+	std::vector<Part> parts_;
+
+	// Sounding notes, one slot per pitch. Bit p of activeMask_ is set while
+	// pitch p sounds, activeEnd_[p] is the sample its note off falls on.
+	// Slots of silent pitches hold stale times.
+	static const int ActiveMaskWords = NumMidiPitches / 32;
+	boost::uint32_t activeMask_[ActiveMaskWords];
+	SampleTime activeEnd_[NumMidiPitches];
+
+	RandomStream random_;
+	unsigned long partsAdded_;
+
+	RingBuffer<Command, MaxCommands> commands_;
+	RingBuffer<Part, MaxParts> retiredParts_;
+	// parts sent and not yet freed, only touched on the script thread.
+	// keeping it below MaxParts means neither parts_ nor retiredParts_ can
+	// run out of room.
+	unsigned long livingParts_;
+
+	// loops of every playing part, only touched off the audio thread
+	std::vector<PartLoopSharedPtr> loops_;
+	boost::mutex loopsMutex_;
+	boost::condition_variable lookaheadWake_;
+	bool stopLookahead_;
+	boost::thread lookaheadThread_;
 };
 
 }
@@ -0,0 +1,240 @@
+#include "Optimize.h"
+#include "Transform.h"
+#include <climits>
+
+using namespace std;
+
+namespace Music
+{
+
+///////////////////////////
+// Graph optimizer
+///////////////////////////
+
+GeneratorSharedPtr GraphOptimizer::Optimize(const GeneratorSharedPtr& gen)
+{
+	if (!gen) {
+		return gen;
+	}
+	map<Generator*, GeneratorSharedPtr>::iterator it = optimized_.find(gen.get());
+	if (it != optimized_.end()) {
+		return it->second;
+	}
+
+	GeneratorSharedPtr result;
+	bool isStatic = dynamic_cast<StaticSequenceGenerator*>(gen.get()) != NULL;
+	if (!isStatic && IsDeterministic(gen.get()) && counter_.Count(gen.get()) <= maxFoldedEvents_) {
+		// the same events come out whatever the random stream, so make them once
+		result = gen->MakeStatic(RandomStream());
+	}
+	else {
+		result = gen->Optimize(*this);
+		if (!result) {
+			result = gen;
+		}
+	}
+	optimized_[gen.get()] = result;
+	return result;
+}
+
+bool GraphOptimizer::IsDeterministic(Generator* gen)
+{
+	if (!gen) {
+		return true;
+	}
+	map<Generator*, bool>::iterator it = deterministic_.find(gen);
+	if (it != deterministic_.end()) {
+		return it->second;
+	}
+	bool deterministic = !gen->IsRandom();
+	vector<Generator*> children;
+	gen->GetChildren(children);
+	for (unsigned long i=0; i<children.size() && deterministic; i++) {
+		deterministic = IsDeterministic(children[i]);
+	}
+	deterministic_[gen] = deterministic;
+	return deterministic;
+}
+
+GeneratorSharedPtr OptimizeGraph(const GeneratorSharedPtr& gen)
+{
+	GraphOptimizer optimizer;
+	return optimizer.Optimize(gen);
+}
+
+///////////////////////////
+// Size estimates
+///////////////////////////
+
+namespace
+{
+
+boost::uint64_t AddCounts(boost::uint64_t a, boost::uint64_t b)
+{
+	return (a == NoEventCount || b > NoEventCount - a) ? NoEventCount : a + b;
+}
+
+boost::uint64_t MultiplyCounts(boost::uint64_t a, boost::uint64_t b)
+{
+	if (a == 0 || b == 0) {
+		return 0;
+	}
+	return (a == NoEventCount || b > NoEventCount / a) ? NoEventCount : a * b;
+}
+
+}
+
+boost::uint64_t EventCounter::Count(Generator* gen)
+{
+	if (!gen) {
+		return 0;
+	}
+	map<Generator*, boost::uint64_t>::iterator it = counts_.find(gen);
+	if (it != counts_.end()) {
+		return it->second;
+	}
+
+	vector<Generator*> children;
+	gen->GetChildren(children);
+	boost::uint64_t count = NoEventCount;
+	if (dynamic_cast<NoteGenerator*>(gen) || dynamic_cast<RestGenerator*>(gen)) {
+		count = 1;
+	}
+	else if (StaticSequenceGenerator* sequence = dynamic_cast<StaticSequenceGenerator*>(gen)) {
+		count = sequence->GetEvents().size;
+	}
+	else if (dynamic_cast<PatternGenerator*>(gen)) {
+		boost::uint64_t itemCount = 0;
+		for (unsigned long i=0; i<children.size(); i++) {
+			itemCount = AddCounts(itemCount, Count(children[i]));
+		}
+		count = MultiplyCounts(itemCount, gen->GetRepeat());
+	}
+	else if (dynamic_cast<WeightedGenerator*>(gen)) {
+		// the longest choice bounds whichever one is made
+		count = 0;
+		for (unsigned long i=0; i<children.size(); i++) {
+			count = std::max(count, Count(children[i]));
+		}
+	}
+	else if (dynamic_cast<TransposeGenerator*>(gen) || dynamic_cast<QuantizeGenerator*>(gen)) {
+		// the first child is the generator, the second the scale
+		count = children.empty() ? 0 : Count(children[0]);
+	}
+	counts_[gen] = count;
+	return count;
+}
+
+boost::uint64_t EstimateBytes(Generator* gen)
+{
+	EventCounter counter;
+	return MultiplyCounts(counter.Count(gen), sizeof(MusicEvent));
+}
+
+///////////////////////////
+// Generator rewrites
+///////////////////////////
+
+GeneratorSharedPtr PatternGenerator::Optimize(GraphOptimizer& optimizer)
+{
+	if (repeat_ == 0 || items_.empty()) {
+		return GeneratorSharedPtr(new StaticSequenceGenerator(EventList()));
+	}
+
+	bool changed = false;
+	vector<GeneratorSharedPtr> items;
+	for (unsigned long i=0; i<items_.size(); i++) {
+		items.push_back(optimizer.Optimize(items_[i]));
+		changed = changed || items[i] != items_[i];
+	}
+
+	// a single item only sees the random stream split off for it, which
+	// makes no difference when it has no random choices to make
+	if (items.size() == 1 && optimizer.IsDeterministic(items[0].get())) {
+		if (repeat_ == 1) {
+			return items[0];
+		}
+		PatternGenerator* inner = dynamic_cast<PatternGenerator*>(items[0].get());
+		if (inner && inner->repeat_ <= ULONG_MAX / repeat_) {
+			return GeneratorSharedPtr(new PatternGenerator(inner->items_, inner->repeat_ * repeat_));
+		}
+	}
+
+	if (!changed) {
+		return GeneratorSharedPtr();
+	}
+	return GeneratorSharedPtr(new PatternGenerator(items, repeat_));
+}
+
+GeneratorSharedPtr WeightedGenerator::Optimize(GraphOptimizer& optimizer)
+{
+	bool changed = false;
+	long onlyChoice = -1;
+	unsigned long choices = 0;
+	vector<WeightedValue> values;
+	for (unsigned long i=0; i<values_.size(); i++) {
+		values.push_back(WeightedValue(optimizer.Optimize(values_[i].first), values_[i].second));
+		changed = changed || values[i].first != values_[i].first;
+		if (values_[i].second > 0) {
+			onlyChoice = i;
+			choices++;
+		}
+	}
+
+	// the choice still uses up a random number, which only matters to a
+	// child that makes random choices of its own
+	if (choices == 1 && optimizer.IsDeterministic(values[onlyChoice].first.get())) {
+		return values[onlyChoice].first;
+	}
+
+	// zero weights stay in, the table maps random numbers to choices by position
+	if (!changed) {
+		return GeneratorSharedPtr();
+	}
+	return GeneratorSharedPtr(new WeightedGenerator(values));
+}
+
+GeneratorSharedPtr TransposeGenerator::Optimize(GraphOptimizer& optimizer)
+{
+	if (!valid_) {
+		return GeneratorSharedPtr();
+	}
+	GeneratorSharedPtr gen = optimizer.Optimize(gen_);
+	if (semitones_ == 0) {
+		return gen;
+	}
+	if (StaticSequenceGenerator* sequence = dynamic_cast<StaticSequenceGenerator*>(gen.get())) {
+		const EventView& view = sequence->GetEvents();
+		EventList events(view.data, view.data + view.size);
+		if (!events.empty()) {
+			TransposeEvents(&events[0], events.size(), semitones_);
+		}
+		return GeneratorSharedPtr(new StaticSequenceGenerator(events));
+	}
+	if (gen == gen_) {
+		return GeneratorSharedPtr();
+	}
+	return GeneratorSharedPtr(new TransposeGenerator(gen, scaleGen_, transposeAmount_));
+}
+
+GeneratorSharedPtr QuantizeGenerator::Optimize(GraphOptimizer& optimizer)
+{
+	if (!valid_) {
+		return GeneratorSharedPtr();
+	}
+	GeneratorSharedPtr gen = optimizer.Optimize(gen_);
+	if (StaticSequenceGenerator* sequence = dynamic_cast<StaticSequenceGenerator*>(gen.get())) {
+		const EventView& view = sequence->GetEvents();
+		EventList events(view.data, view.data + view.size);
+		if (!events.empty()) {
+			MapEventPitches(&events[0], events.size(), map_);
+		}
+		return GeneratorSharedPtr(new StaticSequenceGenerator(events));
+	}
+	if (gen == gen_) {
+		return GeneratorSharedPtr();
+	}
+	return GeneratorSharedPtr(new QuantizeGenerator(gen, scaleGen_, degrees_));
+}
+
+}
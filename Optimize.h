@@ -0,0 +1,81 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "Music.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Graph optimizer
+///////////////////////////
+// Rewrites a generator graph into a cheaper one that plays exactly the same
+// events for every random stream, so a seeded part sounds the same whether
+// it was optimized or not. The input graph is left untouched; rewritten
+// nodes are new, unchanged ones are shared with the input.
+//
+// - Subgraphs without random choices are generated once and frozen into a
+//   static sequence, as long as they are not too long to keep in memory.
+// - Deterministic ones that are too long keep their shape, with nested
+//   single item patterns merged by multiplying their repeat counts and
+//   identity nodes removed.
+// - Transposes and quantizes over static sequences are applied to the
+//   events up front.
+//
+// Subgraphs that make random choices keep their nesting. Every level of a
+// pattern splits the random stream, so flattening them would change which
+// choices a seed makes.
+
+// Longest subgraph output that is frozen, in events
+const unsigned long DefaultMaxFoldedEvents = 65536;
+
+///////////////////////////
+// Size estimates
+///////////////////////////
+// Repeat counts multiply through nested patterns, so a small graph can
+// expand into more events than fit in memory. The counter works out an
+// upper bound from the shape of the graph alone, without generating, so
+// callers can decide up front whether to materialize a graph or stream it.
+
+// Event count of a generator whose output length is not known up front
+const boost::uint64_t NoEventCount = ~static_cast<boost::uint64_t>(0);
+
+class EventCounter
+{
+public:
+	// Most events gen can produce, or NoEventCount if that can not be told
+	// without generating. Shared subgraphs are only counted once.
+	boost::uint64_t Count(Generator* gen);
+
+private:
+	std::map<Generator*, boost::uint64_t> counts_;
+};
+
+// Bytes needed to hold the output of gen, or NoEventCount if unknown
+boost::uint64_t EstimateBytes(Generator* gen);
+
+class GraphOptimizer
+{
+public:
+	explicit GraphOptimizer(unsigned long maxFoldedEvents = DefaultMaxFoldedEvents) : maxFoldedEvents_(maxFoldedEvents) {}
+
+	// Optimize an event generator. Nodes reached more than once are only
+	// optimized once, so shared subgraphs stay shared.
+	GeneratorSharedPtr Optimize(const GeneratorSharedPtr& gen);
+
+	// True if nothing under gen makes a random choice
+	bool IsDeterministic(Generator* gen);
+
+private:
+	unsigned long maxFoldedEvents_;
+	std::map<Generator*, GeneratorSharedPtr> optimized_;
+	std::map<Generator*, bool> deterministic_;
+	EventCounter counter_;
+};
+
+// Shorthand for GraphOptimizer().Optimize(gen)
+GeneratorSharedPtr OptimizeGraph(const GeneratorSharedPtr& gen);
+
+}
+
+#endif
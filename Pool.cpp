@@ -0,0 +1,177 @@
+#include "Pool.h"
+#include <vector>
+#include <boost/thread.hpp>
+
+namespace Music
+{
+
+///////////////////////////
+// Pool allocator
+///////////////////////////
+
+namespace
+{
+
+// blocks come in multiples of this, which is also their alignment
+const std::size_t PoolGranularity = 16;
+const std::size_t NumSizeClasses = MaxPooledSize / PoolGranularity;
+const std::size_t SlabSize = 64 * 1024;
+
+struct FreeBlock
+{
+	FreeBlock* next;
+};
+
+struct ThreadPool
+{
+	ThreadPool() : inUse(false), allocations(0), frees(0), largeAllocations(0), allocatedBytes(0), slabs(0), slabBytes(0)
+	{
+		for (std::size_t i=0; i<NumSizeClasses; i++) {
+			free[i] = NULL;
+		}
+	}
+
+	FreeBlock* free[NumSizeClasses];
+	// owned by a running thread, protected by the registry mutex
+	bool inUse;
+
+	// only written by the owning thread
+	volatile boost::int64_t allocations;
+	volatile boost::int64_t frees;
+	volatile boost::int64_t largeAllocations;
+	volatile boost::int64_t allocatedBytes;
+	volatile boost::int64_t slabs;
+	volatile boost::int64_t slabBytes;
+};
+
+void ReleasePool(ThreadPool* pool);
+
+// every pool ever made. leaked on purpose, blocks may still be freed into
+// a pool during static destruction.
+struct PoolRegistry
+{
+	PoolRegistry() : current(&ReleasePool) {}
+
+	boost::mutex mutex;
+	std::vector<ThreadPool*> pools;
+	boost::thread_specific_ptr<ThreadPool> current;
+};
+
+PoolRegistry* registry = NULL;
+boost::once_flag registryOnce = BOOST_ONCE_INIT;
+
+void CreateRegistry()
+{
+	registry = new PoolRegistry;
+}
+
+// called when a thread exits. the pool stays registered with its free
+// lists and stats and waits for another thread to take it over.
+void ReleasePool(ThreadPool* pool)
+{
+	boost::lock_guard<boost::mutex> lock(registry->mutex);
+	pool->inUse = false;
+}
+
+ThreadPool* GetThreadPool()
+{
+	boost::call_once(registryOnce, &CreateRegistry);
+	ThreadPool* pool = registry->current.get();
+	if (pool) {
+		return pool;
+	}
+
+	{
+		boost::lock_guard<boost::mutex> lock(registry->mutex);
+		for (std::size_t i=0; i<registry->pools.size() && !pool; i++) {
+			if (!registry->pools[i]->inUse) {
+				pool = registry->pools[i];
+			}
+		}
+		if (!pool) {
+			pool = new ThreadPool;
+			registry->pools.push_back(pool);
+		}
+		pool->inUse = true;
+	}
+	registry->current.reset(pool);
+	return pool;
+}
+
+void AddSlab(ThreadPool* pool, std::size_t sizeClass)
+{
+	std::size_t blockSize = (sizeClass + 1) * PoolGranularity;
+	char* slab = static_cast<char*>(::operator new(SlabSize));
+	// thread the blocks onto the free list back to front, so they are
+	// handed out in address order
+	for (std::size_t offset = (SlabSize / blockSize) * blockSize; offset > 0; ) {
+		offset -= blockSize;
+		FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + offset);
+		block->next = pool->free[sizeClass];
+		pool->free[sizeClass] = block;
+	}
+	pool->slabs++;
+	pool->slabBytes += SlabSize;
+}
+
+}
+
+void* PoolAllocate(std::size_t bytes)
+{
+	ThreadPool* pool = GetThreadPool();
+	if (bytes == 0 || bytes > MaxPooledSize) {
+		pool->largeAllocations++;
+		pool->allocatedBytes += bytes;
+		return ::operator new(bytes);
+	}
+	std::size_t sizeClass = (bytes - 1) / PoolGranularity;
+	if (!pool->free[sizeClass]) {
+		AddSlab(pool, sizeClass);
+	}
+	FreeBlock* block = pool->free[sizeClass];
+	pool->free[sizeClass] = block->next;
+	pool->allocations++;
+	pool->allocatedBytes += (sizeClass + 1) * PoolGranularity;
+	return block;
+}
+
+void PoolFree(void* block, std::size_t bytes)
+{
+	if (!block) {
+		return;
+	}
+	if (bytes == 0 || bytes > MaxPooledSize) {
+		::operator delete(block);
+		return;
+	}
+	ThreadPool* pool = GetThreadPool();
+	std::size_t sizeClass = (bytes - 1) / PoolGranularity;
+	FreeBlock* freed = static_cast<FreeBlock*>(block);
+	freed->next = pool->free[sizeClass];
+	pool->free[sizeClass] = freed;
+	pool->frees++;
+}
+
+PoolStats GetPoolStats()
+{
+	boost::call_once(registryOnce, &CreateRegistry);
+	PoolStats stats;
+	boost::lock_guard<boost::mutex> lock(registry->mutex);
+	for (std::size_t i=0; i<registry->pools.size(); i++) {
+		const ThreadPool& pool = *registry->pools[i];
+		stats.allocations += pool.allocations;
+		stats.frees += pool.frees;
+		stats.largeAllocations += pool.largeAllocations;
+		stats.allocatedBytes += pool.allocatedBytes;
+		stats.slabs += pool.slabs;
+		stats.slabBytes += pool.slabBytes;
+	}
+	return stats;
+}
+
+boost::int64_t GetThreadAllocatedBytes()
+{
+	return GetThreadPool()->allocatedBytes;
+}
+
+}
@@ -0,0 +1,99 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <new>
+#include <boost/cstdint.hpp>
+
+namespace Music
+{
+
+///////////////////////////
+// Pool allocator
+///////////////////////////
+// Generation makes and drops a lot of small objects of a handful of sizes:
+// values and the lists that hold them. Each thread keeps free lists of fixed
+// size blocks carved out of larger slabs, so allocating or freeing one is a
+// few instructions and never takes a lock. A block freed on another thread than the one that made it goes on
+// the freeing thread's list. Slabs are never given back; the pool of a
+// thread that exits is picked up by the next thread that starts allocating.
+
+// Blocks larger than this come from operator new
+const std::size_t MaxPooledSize = 256;
+
+void* PoolAllocate(std::size_t bytes);
+void PoolFree(void* block, std::size_t bytes);
+
+struct PoolStats
+{
+	PoolStats() : allocations(0), frees(0), largeAllocations(0), allocatedBytes(0), slabs(0), slabBytes(0) {}
+
+	// pooled blocks handed out and given back
+	boost::int64_t allocations;
+	boost::int64_t frees;
+	// requests too large for the pool
+	boost::int64_t largeAllocations;
+	// bytes handed out, pooled blocks at their full size and large
+	// requests included
+	boost::int64_t allocatedBytes;
+	boost::int64_t slabs;
+	boost::int64_t slabBytes;
+};
+
+// Totals over every thread. Counters of other threads are read without
+// stopping them, so the totals are approximate while they allocate.
+PoolStats GetPoolStats();
+
+// allocatedBytes of the calling thread alone. The difference across a call
+// is what the call allocated on this thread.
+boost::int64_t GetThreadAllocatedBytes();
+
+// Standard allocator on top of the pool, for containers
+template <class T>
+class PoolAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <class U>
+	struct rebind
+	{
+		typedef PoolAllocator<U> other;
+	};
+
+	PoolAllocator() {}
+	template <class U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		return static_cast<pointer>(PoolAllocate(n * sizeof(T)));
+	}
+	void deallocate(pointer p, size_type n)
+	{
+		PoolFree(p, n * sizeof(T));
+	}
+
+	size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+
+	void construct(pointer p, const T& value) { new (p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+};
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+}
+
+#endif
@@ -0,0 +1,678 @@
+#include "Program.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace Music
+{
+
+ProgramSharedPtr CompileProgram(GeneratorSharedPtr gen)
+{
+	if (!gen) {
+		return ProgramSharedPtr();
+	}
+	ProgramSharedPtr program(new Program);
+	ProgramBuilder builder(*program);
+	if (!builder.Build(gen)) {
+		return ProgramSharedPtr();
+	}
+	return program;
+}
+
+///////////////////////////
+// Program stream
+///////////////////////////
+
+ProgramStream::ProgramStream(ProgramSharedPtr program, const RandomStream& random) :
+	program_(program), initialRandom_(random)
+{
+	// every call uses a slot on the main stack, so there can never be more
+	// saved random streams than that
+	stack_.resize(program_->stackSize_ + 1);
+	randomStack_.resize(program_->stackSize_ + 1);
+	mapStack_.resize(program_->maps_.size());
+	Reset();
+}
+
+void ProgramStream::Reset()
+{
+	random_ = initialRandom_;
+	pc_ = 0;
+	sp_ = 0;
+	rsp_ = 0;
+	msp_ = 0;
+	sequencePos_ = 0;
+	pitch_ = 0;
+	velocity_ = 127;
+	length_ = 1.0;
+	transpose_ = 0;
+}
+
+int ProgramStream::GetFinalPitch(int pitch) const
+{
+	pitch += transpose_;
+	for (unsigned long i=msp_; i>0; i--) {
+		const MapFrame& frame = mapStack_[i-1];
+		if (pitch >= 0 && pitch < NumMidiPitches) {
+			pitch = frame.map->pitches[pitch];
+		}
+		pitch += frame.transpose;
+	}
+	return pitch;
+}
+
+bool ProgramStream::Seek(double beat, double& wait)
+{
+	Reset();
+	const vector<Instruction>& code = program_->code_;
+	// the event that ends the walk is never pulled, as with SkipBeats
+	double time = 0;
+	MusicEvent event;
+	while (time < beat) {
+		if (Run(event, true)) {
+			if (event.type == REST_EVENT) {
+				time += event.length;
+			}
+			continue;
+		}
+		if (code[pc_].op != OP_REPEAT) {
+			// end of the program
+			break;
+		}
+		// enter the loop, stepping over the passes that end before beat.
+		// a pass ending right on beat is run, notes after its last rest
+		// start on beat.
+		const Program::LoopBody& body = program_->loops_[pc_];
+		stack_[sp_++] = 0;
+		pc_++;
+		if (body.beats > 0) {
+			unsigned long passes = static_cast<unsigned long>((beat - time) / body.beats);
+			if (passes > 0 && time + passes * body.beats >= beat) {
+				passes--;
+			}
+			passes = min(passes, body.count);
+			if (passes == body.count) {
+				sp_--;
+				pc_ = body.end + 1;
+			}
+			else {
+				stack_[sp_-1] = passes;
+			}
+			time += passes * body.beats;
+		}
+	}
+	wait = time > beat ? time - beat : 0;
+	return true;
+}
+
+bool ProgramStream::Next(MusicEvent& event)
+{
+	return Run(event, false);
+}
+
+bool ProgramStream::Run(MusicEvent& event, bool stopAtRepeat)
+{
+	const vector<Instruction>& code = program_->code_;
+	for (;;)
+	{
+		const Instruction& ins = code[pc_++];
+		switch (ins.op)
+		{
+		case OP_PITCH:
+			pitch_ = ins.arg;
+			break;
+		case OP_VELOCITY:
+			velocity_ = ins.arg;
+			break;
+		case OP_LENGTH:
+			length_ = ins.value;
+			break;
+		case OP_TRANSPOSE:
+			transpose_ += ins.arg;
+			break;
+		case OP_MAP:
+		{
+			MapFrame frame = { &program_->maps_[ins.arg], transpose_ };
+			mapStack_[msp_++] = frame;
+			transpose_ = 0;
+			break;
+		}
+		case OP_UNMAP:
+			transpose_ = mapStack_[--msp_].transpose;
+			break;
+		case OP_NOTE:
+			event = MakeNoteEvent(GetFinalPitch(pitch_), velocity_, length_);
+			return true;
+		case OP_REST:
+			event = MakeRestEvent(length_);
+			return true;
+		case OP_SEQUENCE:
+		{
+			const EventView& sequence = program_->sequences_[ins.arg];
+			if (sequencePos_ < sequence.size) {
+				event = sequence.data[sequencePos_++];
+				if (event.type == NOTE_EVENT) {
+					event.pitch = GetFinalPitch(event.pitch);
+				}
+				// come back to this instruction for the next event
+				pc_--;
+				return true;
+			}
+			sequencePos_ = 0;
+			break;
+		}
+		case OP_CHOOSE:
+		{
+			const Program::Choice& choice = program_->choices_[ins.arg];
+			pc_ = choice.targets[choice.table.Sample(random_.NextUnit())];
+			break;
+		}
+		case OP_JUMP:
+			pc_ = ins.arg;
+			break;
+		case OP_REPEAT:
+			if (stopAtRepeat) {
+				pc_--;
+				return false;
+			}
+			stack_[sp_++] = 0;
+			break;
+		case OP_LOOP:
+			if (++stack_[sp_-1] < static_cast<unsigned long>(ins.arg2)) {
+				pc_ = ins.arg;
+			}
+			else {
+				sp_--;
+			}
+			break;
+		case OP_SPLIT:
+			random_ = randomStack_[rsp_-1].Split(ins.arg);
+			break;
+		case OP_SPLIT_LOOP:
+			// the loop counter of the pattern is on top of the stack
+			random_ = randomStack_[rsp_-1].Split(stack_[sp_-1] * ins.arg2 + ins.arg);
+			break;
+		case OP_CALL:
+			stack_[sp_++] = pc_;
+			randomStack_[rsp_++] = random_;
+			pc_ = ins.arg;
+			break;
+		case OP_RETURN:
+			pc_ = stack_[--sp_];
+			random_ = randomStack_[--rsp_];
+			break;
+		case OP_END:
+		default:
+			// stay on the end instruction
+			pc_--;
+			return false;
+		}
+	}
+}
+
+bool MatchesGraph(ProgramSharedPtr program, GeneratorSharedPtr gen, const RandomStream& random)
+{
+	GenerationContext context(random);
+	EventListSharedPtr expected = gen->GenerateEvents(context);
+	ProgramStream stream(program, random);
+	MusicEvent event;
+	unsigned long count = 0;
+	while (stream.Next(event)) {
+		if (count >= expected->size() || memcmp(&event, &(*expected)[count], sizeof(MusicEvent)) != 0) {
+			return false;
+		}
+		count++;
+	}
+	return count == expected->size();
+}
+
+///////////////////////////
+// Program builder
+///////////////////////////
+
+ProgramBuilder::ProgramBuilder(Program& program) : program_(program), currentSub_(0), depth_(0)
+{
+}
+
+bool ProgramBuilder::Build(GeneratorSharedPtr root)
+{
+	// subroutine 0 is the main program
+	Subroutine main = { NULL, 0, 0 };
+	subs_.push_back(main);
+
+	if (!CompileEvents(root)) {
+		return false;
+	}
+	Emit(OP_END);
+
+	// compiling a subroutine can add new ones to the end of the list
+	for (unsigned long i=1; i<subs_.size(); i++) {
+		currentSub_ = i;
+		depth_ = 0;
+		subs_[i].entry = Position();
+		if (!subs_[i].pattern->CompileBody(*this)) {
+			return false;
+		}
+		Emit(OP_RETURN);
+	}
+
+	for (unsigned long i=0; i<callSites_.size(); i++) {
+		Patch(callSites_[i].first, subs_[callSites_[i].second].entry);
+	}
+
+	vector<long> needed(subs_.size(), -1);
+	program_.stackSize_ = StackNeeded(0, needed);
+
+	Program::LoopBody unknown = { -1, 0, 0 };
+	program_.loops_.assign(program_.code_.size(), unknown);
+	Measure measure = { 0, true, false, 0, false };
+	map<unsigned long, Measure> subs;
+	MeasureBlock(0, measure, subs);
+	program_.takesTime_ = measure.takesTime;
+	return true;
+}
+
+unsigned long ProgramBuilder::MeasureBlock(unsigned long pc, Measure& measure, map<unsigned long, Measure>& subs)
+{
+	const vector<Instruction>& code = program_.code_;
+	for (;;)
+	{
+		const Instruction& ins = code[pc];
+		switch (ins.op)
+		{
+		case OP_LENGTH:
+			measure.lengthKnown = true;
+			measure.length = ins.value;
+			pc++;
+			break;
+		case OP_REST:
+			if (measure.lengthKnown) {
+				measure.beats += measure.length;
+			}
+			else {
+				measure.fixed = false;
+			}
+			if (!measure.lengthKnown || measure.length > 0) {
+				measure.takesTime = true;
+			}
+			pc++;
+			break;
+		case OP_SEQUENCE:
+		{
+			const EventView& sequence = program_.sequences_[ins.arg];
+			for (unsigned long i=0; i<sequence.size; i++) {
+				if (sequence.data[i].type == REST_EVENT) {
+					measure.beats += sequence.data[i].length;
+					if (sequence.data[i].length > 0) {
+						measure.takesTime = true;
+					}
+				}
+			}
+			pc++;
+			break;
+		}
+		case OP_CHOOSE:
+		{
+			// every branch jumps to the end of the choice when it is done
+			const Program::Choice& choice = program_.choices_[ins.arg];
+			Measure joined = measure;
+			bool first = true;
+			for (unsigned long i=0; i<choice.targets.size(); i++) {
+				if (choice.targets[i] == choice.end) {
+					// can never be picked
+					continue;
+				}
+				Measure branch = measure;
+				MeasureBlock(choice.targets[i], branch, subs);
+				if (first) {
+					joined = branch;
+					first = false;
+					continue;
+				}
+				joined.fixed = joined.fixed && branch.fixed && branch.beats == joined.beats;
+				joined.takesTime = joined.takesTime || branch.takesTime;
+				if (!branch.lengthKnown || branch.length != joined.length) {
+					joined.lengthKnown = false;
+				}
+			}
+			measure = joined;
+			pc = choice.end;
+			break;
+		}
+		case OP_REPEAT:
+		{
+			// passes after the first start with what the one before left in
+			// the register, so do not count on it
+			Measure body = { 0, true, false, 0, false };
+			unsigned long end = MeasureBlock(pc + 1, body, subs);
+			Program::LoopBody& loop = program_.loops_[pc];
+			loop.beats = body.fixed ? body.beats : -1;
+			loop.count = code[end].arg2;
+			loop.end = end;
+			measure.beats += body.beats * loop.count;
+			measure.fixed = measure.fixed && body.fixed;
+			measure.takesTime = measure.takesTime || (body.takesTime && loop.count > 0);
+			measure.lengthKnown = body.lengthKnown;
+			measure.length = body.length;
+			pc = end + 1;
+			break;
+		}
+		case OP_CALL:
+		{
+			// subroutines are measured once, wherever they are called from
+			map<unsigned long, Measure>::iterator it = subs.find(ins.arg);
+			if (it == subs.end()) {
+				Measure sub = { 0, true, false, 0, false };
+				MeasureBlock(ins.arg, sub, subs);
+				it = subs.insert(make_pair(static_cast<unsigned long>(ins.arg), sub)).first;
+			}
+			const Measure& sub = it->second;
+			measure.beats += sub.beats;
+			measure.fixed = measure.fixed && sub.fixed;
+			measure.takesTime = measure.takesTime || sub.takesTime;
+			measure.lengthKnown = sub.lengthKnown;
+			measure.length = sub.length;
+			pc++;
+			break;
+		}
+		case OP_LOOP:
+		case OP_JUMP:
+		case OP_RETURN:
+		case OP_END:
+			return pc;
+		default:
+			pc++;
+			break;
+		}
+	}
+}
+
+unsigned long ProgramBuilder::StackNeeded(unsigned long sub, vector<long>& needed)
+{
+	if (needed[sub] >= 0) {
+		return needed[sub];
+	}
+	unsigned long result = subs_[sub].maxDepth;
+	for (unsigned long i=0; i<subs_[sub].calls.size(); i++) {
+		const pair<unsigned long, unsigned long>& call = subs_[sub].calls[i];
+		// the return address takes up one slot on top of the loop counters
+		unsigned long callNeeds = call.second + 1 + StackNeeded(call.first, needed);
+		result = max(result, callNeeds);
+	}
+	needed[sub] = result;
+	return result;
+}
+
+unsigned long ProgramBuilder::Emit(int op, int arg, int arg2, float value)
+{
+	Instruction ins = { op, arg, arg2, value };
+	program_.code_.push_back(ins);
+	return program_.code_.size() - 1;
+}
+
+void ProgramBuilder::Patch(unsigned long at, int arg)
+{
+	program_.code_[at].arg = arg;
+}
+
+bool ProgramBuilder::CompileEvents(const GeneratorSharedPtr& gen)
+{
+	return gen && gen->Compile(*this);
+}
+
+bool ProgramBuilder::CompileValue(const GeneratorSharedPtr& gen, ParameterRegister reg)
+{
+	return gen && gen->CompileValue(*this, reg);
+}
+
+bool ProgramBuilder::SetParameter(ParameterRegister reg, const Value& value)
+{
+	// registers fall back to the same defaults NoteGenerator uses when a
+	// value has the wrong type
+	switch (reg)
+	{
+	case PITCH_REGISTER:
+		if (const PitchSpec* spec = boost::get<PitchSpec>(&value)) {
+			Emit(OP_PITCH, GetPitch(*spec));
+		}
+		else if (const string* str = boost::get<string>(&value)) {
+			Emit(OP_PITCH, GetPitchFromString(*str));
+		}
+		else if (const int* pitch = boost::get<int>(&value)) {
+			Emit(OP_PITCH, *pitch);
+		}
+		else {
+			return SetDefaultParameter(reg);
+		}
+		return true;
+	case VELOCITY_REGISTER:
+		if (const int* velocity = boost::get<int>(&value)) {
+			Emit(OP_VELOCITY, *velocity);
+		}
+		else {
+			return SetDefaultParameter(reg);
+		}
+		return true;
+	case LENGTH_REGISTER:
+		if (const float* length = boost::get<float>(&value)) {
+			Emit(OP_LENGTH, 0, 0, *length);
+		}
+		else {
+			return SetDefaultParameter(reg);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool ProgramBuilder::SetDefaultParameter(ParameterRegister reg)
+{
+	switch (reg)
+	{
+	case PITCH_REGISTER:
+		Emit(OP_PITCH, 0);
+		return true;
+	case VELOCITY_REGISTER:
+		Emit(OP_VELOCITY, 127);
+		return true;
+	case LENGTH_REGISTER:
+		Emit(OP_LENGTH, 0, 0, 1.0);
+		return true;
+	}
+	return false;
+}
+
+bool ProgramBuilder::EmitCall(PatternGenerator* pattern)
+{
+	unsigned long sub;
+	map<PatternGenerator*, unsigned long>::iterator it = subIndices_.find(pattern);
+	if (it != subIndices_.end()) {
+		sub = it->second;
+	}
+	else {
+		Subroutine newSub = { pattern, 0, 0 };
+		sub = subs_.size();
+		subs_.push_back(newSub);
+		subIndices_[pattern] = sub;
+	}
+	subs_[currentSub_].calls.push_back(make_pair(sub, depth_));
+	callSites_.push_back(make_pair(Emit(OP_CALL), sub));
+	return true;
+}
+
+void ProgramBuilder::BeginRepeat()
+{
+	Emit(OP_REPEAT);
+	depth_++;
+	subs_[currentSub_].maxDepth = max(subs_[currentSub_].maxDepth, depth_);
+}
+
+void ProgramBuilder::EndRepeat(unsigned long bodyStart, unsigned long count)
+{
+	Emit(OP_LOOP, bodyStart, count);
+	depth_--;
+}
+
+unsigned long ProgramBuilder::AddChoice()
+{
+	program_.choices_.push_back(Program::Choice());
+	return program_.choices_.size() - 1;
+}
+
+unsigned long ProgramBuilder::AddSequence(const EventView& events)
+{
+	program_.sequences_.push_back(events);
+	return program_.sequences_.size() - 1;
+}
+
+unsigned long ProgramBuilder::AddMap(const PitchMap& map)
+{
+	program_.maps_.push_back(map);
+	return program_.maps_.size() - 1;
+}
+
+///////////////////////////
+// Generator compilation
+///////////////////////////
+
+bool CompileConstant(ProgramBuilder& builder, ParameterRegister reg, const Value& value)
+{
+	return builder.SetParameter(reg, value);
+}
+
+bool NoteGenerator::Compile(ProgramBuilder& builder)
+{
+	if (!builder.CompileValue(pitchGen_, PITCH_REGISTER) ||
+		!builder.CompileValue(velocityGen_, VELOCITY_REGISTER) ||
+		!builder.CompileValue(lengthGen_, LENGTH_REGISTER)) {
+		return false;
+	}
+	builder.Emit(OP_NOTE);
+	return true;
+}
+
+bool RestGenerator::Compile(ProgramBuilder& builder)
+{
+	if (!builder.CompileValue(lengthGen_, LENGTH_REGISTER)) {
+		return false;
+	}
+	builder.Emit(OP_REST);
+	return true;
+}
+
+bool StaticSequenceGenerator::Compile(ProgramBuilder& builder)
+{
+	builder.Emit(OP_SEQUENCE, builder.AddSequence(events_));
+	return true;
+}
+
+bool PatternGenerator::Compile(ProgramBuilder& builder)
+{
+	return builder.EmitCall(this);
+}
+
+bool PatternGenerator::CompileBody(ProgramBuilder& builder)
+{
+	if (items_.empty() || repeat_ == 0) {
+		return true;
+	}
+	bool loop = repeat_ > 1;
+	if (loop) {
+		builder.BeginRepeat();
+	}
+	unsigned long bodyStart = builder.Position();
+	for (unsigned long i=0; i<items_.size(); i++) {
+		builder.Emit(loop ? OP_SPLIT_LOOP : OP_SPLIT, i, items_.size());
+		if (!builder.CompileEvents(items_[i])) {
+			return false;
+		}
+	}
+	if (loop) {
+		builder.EndRepeat(bodyStart, repeat_);
+	}
+	return true;
+}
+
+bool WeightedGenerator::Compile(ProgramBuilder& builder)
+{
+	return CompileChoice(builder, true, PITCH_REGISTER);
+}
+
+bool WeightedGenerator::CompileValue(ProgramBuilder& builder, ParameterRegister reg)
+{
+	return CompileChoice(builder, false, reg);
+}
+
+bool WeightedGenerator::CompileChoice(ProgramBuilder& builder, bool events, ParameterRegister reg)
+{
+	if (table_.Empty()) {
+		// nothing can be chosen. a missing value becomes the register default.
+		return events || builder.SetDefaultParameter(reg);
+	}
+
+	unsigned long choice = builder.AddChoice();
+	builder.Emit(OP_CHOOSE, choice);
+
+	// every value keeps its column, even those that can never be picked, so
+	// a random number picks the same column here as in the graph
+	vector<float> weights;
+	vector<unsigned long> jumps;
+	vector<unsigned long> dead;
+	for (unsigned long i=0; i<values_.size(); i++) {
+		weights.push_back(values_[i].second);
+		if (!(values_[i].second > 0)) {
+			// patched to the end of the choice below
+			dead.push_back(builder.GetChoice(choice).targets.size());
+			builder.GetChoice(choice).targets.push_back(0);
+			continue;
+		}
+		// nested choices add to the choice table, so look the entry up each time
+		builder.GetChoice(choice).targets.push_back(builder.Position());
+
+		bool compiled = events ? builder.CompileEvents(values_[i].first) : builder.CompileValue(values_[i].first, reg);
+		if (!compiled) {
+			return false;
+		}
+		jumps.push_back(builder.Emit(OP_JUMP));
+	}
+	for (unsigned long i=0; i<jumps.size(); i++) {
+		builder.Patch(jumps[i], builder.Position());
+	}
+	Program::Choice& compiled = builder.GetChoice(choice);
+	compiled.end = builder.Position();
+	for (unsigned long i=0; i<dead.size(); i++) {
+		compiled.targets[dead[i]] = compiled.end;
+	}
+	compiled.table.Build(weights);
+	return true;
+}
+
+bool TransposeGenerator::Compile(ProgramBuilder& builder)
+{
+	int semitones;
+	if (!GetTransposeInSemitones(semitones)) {
+		return false;
+	}
+	builder.Emit(OP_TRANSPOSE, semitones);
+	if (!builder.CompileEvents(gen_)) {
+		return false;
+	}
+	builder.Emit(OP_TRANSPOSE, -semitones);
+	return true;
+}
+
+bool QuantizeGenerator::Compile(ProgramBuilder& builder)
+{
+	if (!valid_) {
+		return false;
+	}
+	builder.Emit(OP_MAP, builder.AddMap(map_));
+	if (!builder.CompileEvents(gen_)) {
+		return false;
+	}
+	builder.Emit(OP_UNMAP);
+	return true;
+}
+
+}
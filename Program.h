@@ -0,0 +1,223 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "Music.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Generator programs
+///////////////////////////
+// A generator graph can be lowered into a flat list of instructions that is
+// executed by a small interpreter. Pattern bodies are compiled once as
+// subroutines, so a pattern that is used in several places only appears in
+// the program once.
+
+enum OpCode
+{
+	OP_PITCH,		// pitch register = arg
+	OP_VELOCITY,	// velocity register = arg
+	OP_LENGTH,		// length register = value
+	OP_TRANSPOSE,	// transpose register += arg
+	OP_MAP,			// push pitch map arg with the transpose register, then clear the register
+	OP_UNMAP,		// pop a pitch map and restore the transpose register
+	OP_NOTE,		// emit a note from the registers
+	OP_REST,		// emit a rest from the length register
+	OP_SEQUENCE,	// emit every event of static sequence arg, one per step
+	OP_CHOOSE,		// jump to a weighted random branch of choice table arg
+	OP_JUMP,		// pc = arg
+	OP_REPEAT,		// push a loop counter starting at 0
+	OP_LOOP,		// increment loop counter, jump to arg while it is below arg2
+	OP_SPLIT,		// random stream = pattern stream split for item arg
+	OP_SPLIT_LOOP,	// same as OP_SPLIT for item arg of arg2 in the current loop iteration
+	OP_CALL,		// push return address and random stream, pc = arg
+	OP_RETURN,		// pop return address and random stream
+	OP_END
+};
+
+struct Instruction
+{
+	int op;
+	int arg;
+	int arg2;
+	float value;
+};
+
+class Program
+{
+public:
+	struct Choice
+	{
+		Choice() : end(0) {}
+
+		AliasTable table;
+		// one per column of table. columns that can never be picked point
+		// at end, like every branch does once it is done.
+		std::vector<unsigned long> targets;
+		unsigned long end;
+	};
+
+	Program() : stackSize_(0), takesTime_(true) {}
+
+	std::vector<Instruction> code_;
+	std::vector<Choice> choices_;
+	std::vector<EventView> sequences_;
+	// each map is pushed by a single instruction and there are no cycles in
+	// a program, so there can never be more of them active than this
+	std::vector<PitchMap> maps_;
+	// number of loop counters and return addresses needed to run the program
+	unsigned long stackSize_;
+	// cleared if no way through the program rests for any time, so every
+	// run of it takes none
+	bool takesTime_;
+
+	struct LoopBody
+	{
+		// beats one pass through the body rests for, or negative if that
+		// depends on random choices
+		double beats;
+		unsigned long count;
+		// position of the OP_LOOP that ends the body
+		unsigned long end;
+	};
+	// indexed by the position of each OP_REPEAT, so seeking can skip whole
+	// passes instead of running them
+	std::vector<LoopBody> loops_;
+};
+
+// Lower a generator graph into a program. Returns an empty pointer if part
+// of the graph cannot be compiled.
+ProgramSharedPtr CompileProgram(GeneratorSharedPtr gen);
+
+///////////////////////////
+// Program stream
+///////////////////////////
+// Runs a program, stopping every time an event is emitted. All of the
+// interpreter state is allocated up front so running it never allocates.
+// Random streams are split the same way PatternGenerator::GenerateEvents
+// splits them, so a program and the graph it came from give the same output.
+class ProgramStream : public EventStream
+{
+public:
+	ProgramStream(ProgramSharedPtr program, const RandomStream& random);
+	virtual bool Next(MusicEvent& event);
+	// Programs only run forward, so this restarts and walks up to beat.
+	// Passes of a loop that always take the same time are stepped over
+	// without running them.
+	virtual bool Seek(double beat, double& wait);
+
+	// Start again from the beginning of the program
+	void Reset();
+
+private:
+	struct MapFrame
+	{
+		const PitchMap* map;
+		// transpose register outside the map
+		int transpose;
+	};
+
+	// pitch of a note after the transposes and maps it sits under
+	int GetFinalPitch(int pitch) const;
+	// run up to the next event. with stopAtRepeat, also stop in front of
+	// every OP_REPEAT and return false.
+	bool Run(MusicEvent& event, bool stopAtRepeat);
+
+	ProgramSharedPtr program_;
+	RandomStream initialRandom_;
+	RandomStream random_;
+	unsigned long pc_;
+	unsigned long sp_;
+	unsigned long rsp_;
+	// position inside the static sequence being played
+	unsigned long sequencePos_;
+	std::vector<unsigned long> stack_;
+	std::vector<RandomStream> randomStack_;
+	std::vector<MapFrame> mapStack_;
+	unsigned long msp_;
+	int pitch_;
+	int velocity_;
+	float length_;
+	int transpose_;
+};
+
+// True if running program with random gives the same events as generating
+// gen with it. Meant for checks in debug builds, it generates both in full.
+bool MatchesGraph(ProgramSharedPtr program, GeneratorSharedPtr gen, const RandomStream& random);
+
+///////////////////////////
+// Program builder
+///////////////////////////
+class ProgramBuilder
+{
+public:
+	ProgramBuilder(Program& program);
+
+	// Compile the root of a graph and every subroutine it calls
+	bool Build(GeneratorSharedPtr root);
+
+	unsigned long Emit(int op, int arg = 0, int arg2 = 0, float value = 0);
+	unsigned long Position() const { return program_.code_.size(); }
+	void Patch(unsigned long at, int arg);
+
+	// Compile the events of gen in place
+	bool CompileEvents(const GeneratorSharedPtr& gen);
+	// Compile the first value of gen into a note register
+	bool CompileValue(const GeneratorSharedPtr& gen, ParameterRegister reg);
+	// Load a constant into a note register
+	bool SetParameter(ParameterRegister reg, const Value& value);
+	bool SetDefaultParameter(ParameterRegister reg);
+
+	// Call the body of a pattern, compiling it the first time it is seen
+	bool EmitCall(PatternGenerator* pattern);
+
+	void BeginRepeat();
+	void EndRepeat(unsigned long bodyStart, unsigned long count);
+
+	unsigned long AddChoice();
+	unsigned long AddSequence(const EventView& events);
+	unsigned long AddMap(const PitchMap& map);
+	Program::Choice& GetChoice(unsigned long index) { return program_.choices_[index]; }
+
+private:
+	// time taken by a stretch of code
+	struct Measure
+	{
+		double beats;
+		// cleared once the time depends on a random choice
+		bool fixed;
+		// length register, if it is known
+		bool lengthKnown;
+		float length;
+		// set once a rest that may be longer than zero is passed
+		bool takesTime;
+	};
+
+	// Walk the code from pc to the end of the block it sits in, adding its
+	// time to measure and filling in the loops it passes. Returns the
+	// position of the OP_LOOP, OP_JUMP, OP_RETURN or OP_END it stopped at.
+	unsigned long MeasureBlock(unsigned long pc, Measure& measure, std::map<unsigned long, Measure>& subs);
+
+	struct Subroutine
+	{
+		PatternGenerator* pattern;
+		unsigned long entry;
+		unsigned long maxDepth;
+		// (callee, stack depth at the call)
+		std::vector<std::pair<unsigned long, unsigned long> > calls;
+	};
+
+	unsigned long StackNeeded(unsigned long sub, std::vector<long>& needed);
+
+	Program& program_;
+	std::vector<Subroutine> subs_;
+	std::map<PatternGenerator*, unsigned long> subIndices_;
+	std::vector<std::pair<unsigned long, unsigned long> > callSites_;
+	unsigned long currentSub_;
+	unsigned long depth_;
+};
+
+}
+
+#endif
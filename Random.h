@@ -0,0 +1,61 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <boost/cstdint.hpp>
+
+namespace Music
+{
+
+///////////////////////////
+// Random stream
+///////////////////////////
+// Counter based random number stream. Every number is a pure function of the
+// stream's key and a counter, so any point in the stream can be reached
+// directly with Seek, and Split derives independent streams that can be
+// handed to different subtrees or threads. Nothing is shared between
+// streams, so generation does not depend on any global random state.
+class RandomStream
+{
+public:
+	RandomStream(boost::uint64_t key = 0, boost::uint64_t counter = 0) : key_(key), counter_(counter) {}
+
+	boost::uint64_t NextInt()
+	{
+		counter_++;
+		return Mix(key_ + counter_ * 0x9E3779B97F4A7C15ULL);
+	}
+
+	// Uniformly distributed random number in [0, 1) with 53 bits of resolution
+	double NextUnit()
+	{
+		return (NextInt() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	// Derive an independent stream for child number index. The result
+	// depends on the current position, not just the key.
+	RandomStream Split(boost::uint64_t index) const
+	{
+		boost::uint64_t key = Mix(key_ ^ Mix(counter_ + 0x632BE59BD9B4E019ULL)) ^ Mix(index * 0xD1B54A32D192ED03ULL + 1);
+		return RandomStream(key, 0);
+	}
+
+	void Seek(boost::uint64_t counter) { counter_ = counter; }
+	boost::uint64_t Key() const { return key_; }
+	boost::uint64_t Counter() const { return counter_; }
+
+private:
+	// SplitMix64 finalizer
+	static boost::uint64_t Mix(boost::uint64_t z)
+	{
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	boost::uint64_t key_;
+	boost::uint64_t counter_;
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include "Atomic.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Ring buffer
+///////////////////////////
+// Fixed size queue between exactly one producer thread and one consumer
+// thread. Neither side ever waits or allocates: a push into a full buffer
+// and a look into an empty one fail straight away.
+//
+// Items are copied into their slot by the producer and stay there after
+// the consumer pops them, until the producer reuses the slot. Whatever the
+// consumer leaves behind in a slot is released on the producer thread, so
+// a consumer that must not free memory swaps out what it wants to keep.
+template <class T, unsigned long Capacity>
+class RingBuffer
+{
+public:
+	RingBuffer() : read_(0), write_(0) {}
+
+	// Producer side. Returns false if the buffer is full.
+	bool Push(const T& item)
+	{
+		long write = write_;
+		long next = Advance(write);
+		if (next == AtomicLoad(&read_)) {
+			return false;
+		}
+		slots_[write] = item;
+		AtomicStore(&write_, next);
+		return true;
+	}
+
+	// Consumer side. The oldest item, or NULL if the buffer is empty. The
+	// item stays queued until Pop is called.
+	T* Front()
+	{
+		long read = read_;
+		if (read == AtomicLoad(&write_)) {
+			return NULL;
+		}
+		return &slots_[read];
+	}
+
+	void Pop()
+	{
+		AtomicStore(&read_, Advance(read_));
+	}
+
+private:
+	// one slot is always left empty to tell a full buffer from an empty one
+	static const long Slots = Capacity + 1;
+
+	static long Advance(long index)
+	{
+		return index + 1 == Slots ? 0 : index + 1;
+	}
+
+	T slots_[Slots];
+	// next slot to read, only written by the consumer
+	volatile long read_;
+	// next slot to write, only written by the producer
+	volatile long write_;
+};
+
+}
+
+#endif
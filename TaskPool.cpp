@@ -0,0 +1,118 @@
+#include "TaskPool.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Task pool
+///////////////////////////
+
+TaskPool::TaskPool(unsigned long threads) : stopping_(false)
+{
+	if (threads == 0) {
+		threads = boost::thread::hardware_concurrency();
+	}
+	if (threads == 0) {
+		threads = 1;
+	}
+	for (unsigned long i=0; i<threads; i++) {
+		threads_.push_back(boost::shared_ptr<boost::thread>(new boost::thread(&TaskPool::WorkerLoop, this)));
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	taskAdded_.notify_all();
+	for (unsigned long i=0; i<threads_.size(); i++) {
+		threads_[i]->join();
+	}
+}
+
+void TaskPool::Push(const Task& task, TaskGroup* group)
+{
+	{
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		QueuedTask queued = { task, group };
+		queue_.push_back(queued);
+		group->pending_++;
+	}
+	taskAdded_.notify_one();
+}
+
+bool TaskPool::RunOne(boost::unique_lock<boost::mutex>& lock)
+{
+	if (queue_.empty()) {
+		return false;
+	}
+	QueuedTask queued = queue_.front();
+	queue_.pop_front();
+
+	lock.unlock();
+	queued.task();
+	lock.lock();
+
+	queued.group->pending_--;
+	taskDone_.notify_all();
+	return true;
+}
+
+void TaskPool::WorkerLoop()
+{
+	boost::unique_lock<boost::mutex> lock(mutex_);
+	for (;;)
+	{
+		if (RunOne(lock)) {
+			continue;
+		}
+		if (stopping_) {
+			return;
+		}
+		taskAdded_.wait(lock);
+	}
+}
+
+void TaskGroup::Run(const TaskPool::Task& task)
+{
+	pool_.Push(task, this);
+}
+
+void TaskGroup::Wait()
+{
+	boost::unique_lock<boost::mutex> lock(pool_.mutex_);
+	while (pending_ > 0)
+	{
+		// help out instead of sleeping, the task we are waiting for may be
+		// stuck behind others in the queue
+		if (!pool_.RunOne(lock)) {
+			pool_.taskDone_.wait(lock);
+		}
+	}
+}
+
+namespace
+{
+
+// leaked on purpose so worker threads are never joined during static
+// destruction
+TaskPool* generationPool = NULL;
+boost::once_flag generationPoolOnce = BOOST_ONCE_INIT;
+
+void CreateGenerationPool()
+{
+	generationPool = new TaskPool;
+}
+
+}
+
+TaskPool& GetGenerationPool()
+{
+	// local statics are not initialized thread safely by every compiler we build with
+	boost::call_once(generationPoolOnce, &CreateGenerationPool);
+	return *generationPool;
+}
+
+}
@@ -0,0 +1,81 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <deque>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace Music
+{
+
+class TaskGroup;
+
+///////////////////////////
+// Task pool
+///////////////////////////
+// Fixed set of worker threads that run queued tasks. Tasks are added
+// through a TaskGroup so the caller can wait for just the ones it started.
+// A thread that waits on a group runs queued tasks itself while it waits,
+// so tasks can start and wait on tasks of their own without running out of
+// workers.
+class TaskPool
+{
+public:
+	typedef boost::function<void ()> Task;
+
+	// threads = 0 uses one worker per hardware thread
+	explicit TaskPool(unsigned long threads = 0);
+	~TaskPool();
+
+	unsigned long Size() const { return threads_.size(); }
+
+private:
+	friend class TaskGroup;
+
+	struct QueuedTask
+	{
+		Task task;
+		TaskGroup* group;
+	};
+
+	void Push(const Task& task, TaskGroup* group);
+	// run one queued task if there is one. lock must be held on entry and is
+	// held again on return.
+	bool RunOne(boost::unique_lock<boost::mutex>& lock);
+	void WorkerLoop();
+
+	std::vector<boost::shared_ptr<boost::thread> > threads_;
+	std::deque<QueuedTask> queue_;
+	boost::mutex mutex_;
+	boost::condition_variable taskAdded_;
+	boost::condition_variable taskDone_;
+	bool stopping_;
+};
+
+// Tasks started together and waited on together
+class TaskGroup
+{
+public:
+	TaskGroup(TaskPool& pool) : pool_(pool), pending_(0) {}
+	~TaskGroup() { Wait(); }
+
+	void Run(const TaskPool::Task& task);
+	// Block until every task in the group has finished
+	void Wait();
+
+private:
+	friend class TaskPool;
+
+	TaskPool& pool_;
+	// protected by the pool's mutex
+	unsigned long pending_;
+};
+
+// Pool shared by all generation passes, created the first time it is used
+TaskPool& GetGenerationPool();
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include "Transform.h"
+#include <cstddef>
+#include <boost/static_assert.hpp>
+
+// the Win32 project builds with /arch:SSE2, which sets _M_IX86_FP to 2
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define MUSIC_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace Music
+{
+
+// the vector kernels rely on where pitch and type sit inside an event
+BOOST_STATIC_ASSERT(offsetof(MusicEvent, pitch) == 0);
+BOOST_STATIC_ASSERT(offsetof(MusicEvent, velocity) == 2);
+BOOST_STATIC_ASSERT(offsetof(MusicEvent, type) == 3);
+
+void TransposeEvents(MusicEvent* events, unsigned long count, int semitones)
+{
+	unsigned long i = 0;
+#ifdef MUSIC_SSE2
+	// two events per register. seen as 16 bit lanes an event is pitch,
+	// velocity | type << 8, then two lanes of length.
+	const __m128i offset = _mm_set_epi16(0, 0, 0, static_cast<short>(semitones), 0, 0, 0, static_cast<short>(semitones));
+	const __m128i noteType = _mm_set1_epi16(NOTE_EVENT);
+	for (; i + 2 <= count; i += 2) {
+		__m128i* p = reinterpret_cast<__m128i*>(events + i);
+		__m128i v = _mm_loadu_si128(p);
+		// compare the type byte of each event, then move the result down
+		// into the pitch lane where it masks the offset
+		__m128i isNote = _mm_cmpeq_epi16(_mm_srli_epi16(v, 8), noteType);
+		isNote = _mm_srli_epi64(isNote, 16);
+		v = _mm_add_epi16(v, _mm_and_si128(isNote, offset));
+		_mm_storeu_si128(p, v);
+	}
+#endif
+	for (; i<count; i++) {
+		if (events[i].type == NOTE_EVENT) {
+			events[i].pitch += semitones;
+		}
+	}
+}
+
+void MapEventPitches(MusicEvent* events, unsigned long count, const PitchMap& map)
+{
+	// a table lookup per note does not vectorize without gathers, but the
+	// array is walked once with no branches other than the range check
+	for (unsigned long i=0; i<count; i++) {
+		MusicEvent& event = events[i];
+		if (event.type == NOTE_EVENT && event.pitch >= 0 && event.pitch < NumMidiPitches) {
+			event.pitch = map.pitches[event.pitch];
+		}
+	}
+}
+
+}
@@ -0,0 +1,23 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "Music.h"
+
+namespace Music
+{
+
+///////////////////////////
+// Event transforms
+///////////////////////////
+// Kernels that rewrite the pitches of a whole array of events in one pass.
+// Rests are left alone.
+
+// Add semitones to the pitch of every note
+void TransposeEvents(MusicEvent* events, unsigned long count, int semitones);
+
+// Replace the pitch of every note between 0 and 127 with its entry in map
+void MapEventPitches(MusicEvent* events, unsigned long count, const PitchMap& map);
+
+}
+
+#endif
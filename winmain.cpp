@@ -29,7 +29,7 @@ bool audioStarted = false;
 static float** vstOutputBuffer = NULL;
 
 vector<Music::Track::Event> songEvents;
-vector<float> songOffsets;
+vector<unsigned long> songOffsets;
 
 HINSTANCE gHinstance;
 int gCmdShow;
@@ -237,8 +237,6 @@ static int portaudioCallback( const void *inputBuffer, void *outputBuffer,
 {
     (void) inputBuffer;
 
-	float timeElapsedInMs = framesPerBuffer / (float)AUDIO_SAMPLE_RATE * 1000;
-
 	float** vstOut = (float**)vstOutputBuffer;
 
 	float *out = (float*)outputBuffer;
@@ -247,6 +245,8 @@ static int portaudioCallback( const void *inputBuffer, void *outputBuffer,
 		*out++ = 0;
 	}
 
+	Music::Transport& transport = GetTransport();
+	transport.BeginBlock();
 	list<boost::shared_ptr<SongTrack> >& tracks = GetTracks();
 	typedef list<boost::shared_ptr<SongTrack> >::iterator TrackIter;
 	for (TrackIter i=tracks.begin(); i != tracks.end(); i++)
@@ -267,14 +267,7 @@ static int portaudioCallback( const void *inputBuffer, void *outputBuffer,
 		songOffsets.clear();
 
 		// Process events
-		track->Update(0, timeElapsedInMs, songEvents, songOffsets);
-
-		// convert offsets to samples
-		for (int j=0; j<songEvents.size(); j++) {
-			// first convert offset to samples
-			int offsetInSamples = static_cast<int>(songOffsets[j] / 1000 * AUDIO_SAMPLE_RATE);
-			songOffsets[j] = static_cast<float>(offsetInSamples);
-		}
+		track->Update(transport.GetPosition(), framesPerBuffer, songEvents, songOffsets);
 
 		// check for note-off / note-on pairs at the same pitch and time.
 		// some vsts require that the note-on be atleast one sample after the note-off.
@@ -311,6 +304,8 @@ static int portaudioCallback( const void *inputBuffer, void *outputBuffer,
 		}
 	}
 	
+	transport.Advance(framesPerBuffer);
+
 	// End process events
     return 0;
 }